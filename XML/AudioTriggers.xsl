@@ -117,7 +117,7 @@ color: #333333;
 			<xsl:for-each select="attach_trigger">
 			<tr>
 			<td><a href="#TRIGGER{@name}"><xsl:value-of select="@name"/></a></td>
-			<td><xsl:apply-templates/></td>
+			<td><xsl:apply-templates select="stop_search_on_match"/></td>
 			</tr>
 			</xsl:for-each>
 		</tbody>
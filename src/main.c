@@ -3,8 +3,10 @@
  *
  * Copyright Corey Ashford 2010
  */
+#define _GNU_SOURCE
 #include "../inc/fmod.h"
 #include "../inc/fmod_errors.h"
+#include "../inc/fmodlinux.h"
 #include <time.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -14,11 +16,21 @@
 #include <ctype.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <signal.h>
+#include <limits.h>
+#include <setjmp.h>
 
 
 #include <libxml/tree.h>
@@ -26,6 +38,7 @@
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
 #include <libxml/xmlschemas.h>
+#include <libxml/xmlreader.h>
 
 #define DEBUG 0
 #if DEBUG
@@ -34,21 +47,66 @@
 #define debugmsg(args...)
 #endif
 
+/*
+ * Token bucket rate limiter.  It is implemented as GCRA (the generic cell
+ * rate algorithm), which keeps the entire bucket state in a single
+ * "theoretical arrival time", so it can be shared between logwatcher
+ * threads and updated with a compare-and-swap instead of a lock.
+ */
+struct rate_limit {
+	int64_t interval_ns;	/* time to earn back one token, 0 = unlimited */
+	int64_t tolerance_ns;	/* (burst - 1) * interval_ns */
+	_Atomic int64_t tat;	/* theoretical arrival time of the next event */
+};
+
 struct attached_trigger {
 	xmlChar *name;
 	int trigger_id;
 	bool stop_search_on_match;
+	struct rate_limit rate_limit;
+};
+
+/*
+ * A logfile's attached triggers compiled for matching, one array per
+ * field, so that the logwatcher streams through the few bytes it looks at
+ * for every line instead of chasing pointers to each trigger and pattern.
+ * The patterns are folded to lower case and stored one after the other in
+ * a single block.  A logwatcher only matches against the triggers whose
+ * group is active in its log, through a variant of the table with just
+ * those, see select_trigger_table().
+ */
+#define MAX_TRIGGER_GROUPS 64
+#define NO_GROUP -1
+struct trigger_table {
+	int count;
+	unsigned int *pattern_len;
+	unsigned char *first_byte;	/* of the pattern, '\0' if it is empty */
+	unsigned int *pattern_offset;	/* into patterns */
+	int *trigger_id;
+	int *sound_id;
+	bool *stop_search_on_match;
+	int *attached;			/* index into the logfile's attached_triggers */
+	signed char *group;		/* of the trigger, or NO_GROUP; not in variants */
+	uint64_t groups_used;		/* bit n set if an entry is in group n */
+	char *patterns;
+	unsigned int patterns_size;
 };
 
 struct logfile {
 	xmlChar *file;
+	struct rate_limit rate_limit;
 	struct attached_trigger *attached_triggers;
 	int num_attached_triggers;
+	struct trigger_table table;	/* set up by pack_config() */
 };
-struct logfile *logfiles;
+
+struct config;
 
 struct event_buffer_entry {
+	struct config *config;	/* the sound_id is in this config, which the event holds a reference to */
 	int sound_id;
+	int64_t enqueued;	/* CLOCK_MONOTONIC time the match was found, in ns */
+	time_t log_time;	/* time stamp of the log line, or -1 if unknown */
 };
 
 /* NUM_EVENTS must be a power of 2 */
@@ -62,21 +120,90 @@ struct event_buffer {
 
 struct event_buffer events;
 
+/* A logwatcher thread; the list of them is only touched by the main thread */
 struct log_file_info {
 	pthread_t thread;
 	FILE *file;
+	xmlChar *name;
+	/* set when a reload drops the log file, the thread then frees this */
+	_Atomic bool stop;
+	struct log_file_info *next;
+};
+
+static struct log_file_info *logwatchers;
+
+/* Scheduling and CPU placement for a class of threads, from <runtime> */
+struct thread_settings {
+	int policy;		/* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+	int priority;		/* only used with SCHED_FIFO and SCHED_RR */
+	int nice;
+	bool set_nice;
+#ifdef CPU_SETSIZE
+	cpu_set_t cpus;
+#endif
+	bool set_cpus;
+};
+
+struct runtime {
+	struct thread_settings dispatcher;
+	struct thread_settings logwatcher;
+	long dedup_window;	/* default <dedup_window> for triggers, in ms */
+};
+struct runtime runtime;
+
+/* Which channel gets cut off to make room for a new sound when all are busy */
+enum voice_stealing {
+	STEAL_NONE,		/* drop the new sound */
+	STEAL_PRIORITY,		/* the least important, then the oldest */
+	STEAL_OLDEST,
+	STEAL_QUIETEST,
 };
 
-struct log_file_info *lfi;
+/* Sound system settings, from <audio> */
+struct audio_settings {
+	long update_interval;	/* ms between FMOD_System_Update() calls */
+	enum voice_stealing voice_stealing;
+	int channels;		/* channels that are really mixed */
+	int virtual_voices;	/* channels FMOD keeps track of, audible or not */
+	FMOD_OUTPUTTYPE output;
+	xmlChar *driver_arguments;	/* ALSA device arguments, or the wavwriter file name */
+	int sample_rate;		/* 0 = FMOD's default, as are the next two */
+	unsigned int dsp_buffer_length;
+	int dsp_num_buffers;
+	long sound_memory_budget;	/* MB, 0 = unlimited */
+	long stream_threshold;		/* KB, bigger files are streamed */
+	long sound_cache_size;		/* MB, 0 = load every sound at startup */
+	xmlChar *sound_bank;		/* pre-decoded sound bank file, if any */
+};
+struct audio_settings audio;
 
-#define NUM_CHANNELS 32
 #define NO_SOUND -1
 
-FMOD_CHANNEL *channel[NUM_CHANNELS];
+/*
+ * Every sound that is played gets a channel slot, which goes back on the
+ * free list when FMOD calls the channel's END callback.  FMOD only makes
+ * those callbacks from inside FMOD_System_Update(), which is only called
+ * by the dispatcher, so the free list is never touched by more than one
+ * thread.  The channel's user data holds the slot number and the slot's
+ * generation, so a late callback for a slot that was reused is ignored.
+ */
+#define SLOT_BITS 16
+struct channel_slot {
+	FMOD_CHANNEL *channel;
+	unsigned int generation;
+	bool in_use;
+	struct config *config;	/* holds a reference while in use */
+	int sound_id;
+	int prio;		/* FMOD priority, 0 is the most important */
+	int64_t started;
+};
+static struct channel_slot *channel_slots;
+static int *free_slots;
+static int num_channel_slots;
+static int num_free_slots;
 
-static int num_sounds;
-static int num_triggers;
-static int num_logfiles;
+/* played in place of sounds that haven't finished loading */
+static FMOD_SOUND *default_beep;
 
 void _ERRCHECK(FMOD_RESULT result, const char *file, const char *func, int linenum) {
 	if (result != FMOD_OK) {
@@ -87,128 +214,573 @@ void _ERRCHECK(FMOD_RESULT result, const char *file, const char *func, int linen
 
 #define ERRCHECK(result) _ERRCHECK(result, __FILE__, __func__, __LINE__)
 
-const char *case_insensitive_strstr(const char *search_in, const char *search_for)
+/*
+ * A log message folded to lower case, which is how trigger patterns are
+ * stored, with a bitmap of the bytes it contains: a pattern whose first
+ * byte isn't in the line can't match, whatever else is in it.
+ */
+struct folded_line {
+	char *text;
+	size_t len, size;
+	uint64_t bytes[256 / 64];
+};
+
+static void fold_line(struct folded_line *line, const char *msg)
 {
-	if (*search_for == '\0') {
-		return search_in;
+	size_t len = strlen(msg), i;
+	unsigned char c;
+
+	if (len + 1 > line->size) {
+		line->size = len + 1;
+		line->text = realloc(line->text, line->size);
 	}
-	for (; *search_in; ++search_in) {
-		if (toupper((int)*search_in) == toupper((int)*search_for)) {
-			/*
-			 * Matched starting char -- loop through remaining chars.
-			 */
-			const char *_in, *_for;
-			for (_in = search_in, _for = search_for; *_in && *_for; ++_in, ++_for) {
-				if (toupper((int)*_in) != toupper((int)*_for)) {
-					break;
-				}
-			}
-			if (!*_for) /* matched all of 'search_for' till the null terminator */
-			{
-				return search_in; /* return the start of the match */
-			}
-		}
+	memset(line->bytes, 0, sizeof(line->bytes));
+	/* an empty pattern matches anything */
+	line->bytes[0] = 1;
+	for (i = 0; i < len; i++) {
+		c = tolower((unsigned char)msg[i]);
+		line->text[i] = c;
+		line->bytes[c >> 6] |= 1ULL << (c & 63);
 	}
-	return NULL;
+	line->text[len] = '\0';
+	line->len = len;
+}
+
+/* Does the pattern of entry i of a trigger table occur in line? */
+static inline bool trigger_table_match(const struct trigger_table *table, int i,
+		const struct folded_line *line)
+{
+	unsigned char c = table->first_byte[i];
+
+	if (table->pattern_len[i] > line->len || !(line->bytes[c >> 6] & (1ULL << (c & 63))))
+		return false;
+	return memmem(line->text, line->len, table->patterns + table->pattern_offset[i],
+			table->pattern_len[i]) != NULL;
+}
+
+/*
+ * The variants of a logfile's trigger table that a logwatcher has needed,
+ * keyed by which of the table's groups are active.  Only a few are ever
+ * used in practice, one per zone or so, so they are built on first use
+ * and kept until the config changes.
+ */
+#define MAX_TABLE_VARIANTS 16
+struct table_variants {
+	int count;
+	uint64_t key[MAX_TABLE_VARIANTS];
+	struct trigger_table *table[MAX_TABLE_VARIANTS];
+};
+
+static void free_table_variants(struct table_variants *variants)
+{
+	int i;
+
+	for (i = 0; i < variants->count; i++)
+		free(variants->table[i]);
+	variants->count = 0;
+}
+
+/* A copy of full with just the entries that aren't in a group, or are in one of active */
+static struct trigger_table *build_table_variant(const struct trigger_table *full, uint64_t active)
+{
+	struct trigger_table *table;
+	int i, n = 0;
+	char *p;
+
+	for (i = 0; i < full->count; i++) {
+		if (full->group[i] == NO_GROUP || (active & (1ULL << full->group[i])))
+			n++;
+	}
+	/* one block, with the arrays of ints first to keep them aligned */
+	table = malloc(sizeof(struct trigger_table) + n * (2 * sizeof(unsigned int) + 3 * sizeof(int) + 1 + sizeof(bool)));
+	p = (char *)(table + 1);
+	table->pattern_len = (unsigned int *)p;
+	p += n * sizeof(unsigned int);
+	table->pattern_offset = (unsigned int *)p;
+	p += n * sizeof(unsigned int);
+	table->trigger_id = (int *)p;
+	p += n * sizeof(int);
+	table->sound_id = (int *)p;
+	p += n * sizeof(int);
+	table->attached = (int *)p;
+	p += n * sizeof(int);
+	table->first_byte = (unsigned char *)p;
+	p += n;
+	table->stop_search_on_match = (bool *)p;
+	table->group = NULL;
+	table->groups_used = 0;
+	table->patterns = full->patterns;
+	table->patterns_size = full->patterns_size;
+	table->count = 0;
+	for (i = 0; i < full->count; i++) {
+		if (full->group[i] != NO_GROUP && !(active & (1ULL << full->group[i])))
+			continue;
+		table->pattern_len[table->count] = full->pattern_len[i];
+		table->pattern_offset[table->count] = full->pattern_offset[i];
+		table->trigger_id[table->count] = full->trigger_id[i];
+		table->sound_id[table->count] = full->sound_id[i];
+		table->attached[table->count] = full->attached[i];
+		table->first_byte[table->count] = full->first_byte[i];
+		table->stop_search_on_match[table->count] = full->stop_search_on_match[i];
+		table->count++;
+	}
+	return table;
+}
+
+/* The trigger table to match a log's lines against while the groups in active are */
+static const struct trigger_table *select_trigger_table(struct table_variants *variants,
+		const struct trigger_table *full, uint64_t active)
+{
+	uint64_t key = active & full->groups_used;
+	int i;
+
+	if (key == full->groups_used)
+		return full;
+	for (i = 0; i < variants->count; i++) {
+		if (variants->key[i] == key)
+			return variants->table[i];
+	}
+	if (variants->count == MAX_TABLE_VARIANTS)
+		free_table_variants(variants);
+	variants->key[variants->count] = key;
+	variants->table[variants->count] = build_table_variant(full, key);
+	return variants->table[variants->count++];
 }
 
 #define NS_IN_SEC 1000000000
-static inline struct timespec timespec_diff(const struct timespec * a, const struct timespec *  b)
-{
-    if(a->tv_nsec < b->tv_nsec)
-    {
-        struct timespec result = {
-            a->tv_sec - b->tv_sec - 1,
-            NS_IN_SEC + a->tv_nsec - b->tv_nsec,
-        };
-        return result;
-    } else
-    {
-        struct timespec result = {
-            a->tv_sec - b->tv_sec,
-            a->tv_nsec - b->tv_nsec,
-        };
-        return result;
-    }
-}
-
-static inline long int timespec2ms(const struct timespec * a) {
-	long sec = a->tv_sec;
-
-	/* No more than 100 seconds */
-	if (sec > 100)
-			sec = 100;
-	return (sec * 1000) + (a->tv_nsec / 1000000);
+#define NS_IN_MS 1000000
+
+static inline int64_t now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * NS_IN_SEC + now.tv_nsec;
+}
+
+static void init_rate_limit(struct rate_limit *rl, long burst, long interval_ms)
+{
+	if (burst < 1)
+		burst = 1;
+	rl->interval_ns = (int64_t)interval_ms * NS_IN_MS;
+	rl->tolerance_ns = (burst - 1) * rl->interval_ns;
+	atomic_init(&rl->tat, 0);
 }
 
+/* Take a token from the bucket if there is one; returns false if the event should be dropped */
+static bool rate_limit_allow(struct rate_limit *rl, int64_t now)
+{
+	int64_t tat, start;
+
+	if (rl->interval_ns <= 0)
+		return true;
+
+	tat = atomic_load_explicit(&rl->tat, memory_order_relaxed);
+	do {
+		start = tat > now ? tat : now;
+		if (start - now > rl->tolerance_ns)
+			return false;
+	} while (!atomic_compare_exchange_weak_explicit(&rl->tat, &tat,
+			start + rl->interval_ns,
+			memory_order_relaxed, memory_order_relaxed));
+	return true;
+}
+
+/* How a sound's data is kept once it is loaded, from <storage> */
+enum sound_storage {
+	STORAGE_AUTO,
+	STORAGE_PCM,		/* decoded to PCM up front */
+	STORAGE_COMPRESSED,	/* MP3/ADPCM kept compressed, decoded while playing */
+	STORAGE_STREAM,		/* read from disk while playing */
+};
+
+/* Sounds are loaded in the background; until one is ready, a beep is played in its place */
+enum sound_state {
+	SOUND_UNLOADED,		/* on demand sounds, until first played or once evicted */
+	SOUND_LOADING,
+	SOUND_READY,
+	SOUND_FAILED,
+};
+
 /* sentinel to indicate taking the system default sound attributes */
 #define USE_DEFAULT -1000.0
 #define USE_DEFAULT_PRIO -1000
+/* FMOD's own default priority */
+#define DEFAULT_PRIO 128
+/*
+ * The loaded audio of a sound file.  <sound>s that play the same file, or
+ * an identical copy of it, with the same storage share one, and apply
+ * their own vol, pan and priority to the channel each time they play.
+ * Sound data outlives config reloads, so sounds that didn't change keep
+ * playing from the same FMOD_SOUND.  Once the dispatcher is running, it
+ * shares the entries with a reload under sound_data_lock.
+ */
+struct sound_data {
+	FMOD_SOUND *fmod_sound;
+	char *path;		/* canonical, NULL once the entry is free for reuse */
+	off_t size;		/* the version of the file it was made for */
+	time_t mtime;
+	long mtime_nsec;
+	dev_t dev;
+	ino_t ino;
+	bool hashed;
+	uint64_t hash;		/* of the file's contents, only worked out when needed */
+	enum sound_storage storage;
+	enum sound_state state;
+	bool preload;		/* with a sound cache, load at startup and never evict */
+	float vol, pan;		/* the file's own defaults, once it is loaded */
+	int prio;
+	int num_playing;
+	unsigned int memory;	/* bytes, once loaded */
+	int64_t last_used;
+	unsigned long loads, evictions;
+	bool in_cache;		/* counted in sound_cache_used */
+	/* played, in order, once an on demand sound has loaded */
+	struct event_buffer_entry *pending;
+	int num_pending;
+};
+static struct sound_data *sound_data;
+static int num_sound_data;
+static int sound_data_size;
+/* only held by a reload while it isn't reading a file, so the dispatcher isn't held up */
+static pthread_mutex_t sound_data_lock = PTHREAD_MUTEX_INITIALIZER;
+/* the new config a reload is finding the sound data of, until it is installed */
+static struct config *resolving_config;
+
 struct sound {
 	xmlChar *name;
 	xmlChar *file;
 	int prio;
 	float vol, pan;
-	long min_interval;
-	struct timespec timestamp;
+	/* min_interval is a rate limit with a bucket size of one */
+	struct rate_limit min_interval;
+	/* events older than this (in ms) are discarded instead of played, 0 = never */
+	long max_age;
+	int max_polyphony;	/* 0 = unlimited */
+	enum sound_storage storage;
+	bool preload;
+	int data_id;
+	/* the rest is only used by the dispatcher */
+	int num_playing;
+	unsigned long plays;
+};
+
+struct trigger {
+	xmlChar *name;
+	xmlChar *pattern;
+	xmlChar *sound_to_play;
+	int sound_to_play_id;
+	/* a trigger in a group is only looked for while the group is active */
+	xmlChar *group;
+	int group_id;
+	/* lists of groups that a match turns on and off in its log */
+	xmlChar *enable_groups, *disable_groups;
+	uint64_t enables, disables;
+	struct rate_limit rate_limit;
+	int64_t dedup_window_ns;	/* 0 means don't deduplicate */
+};
+
+/* What a file atconfig.xml includes or imports is read as */
+enum import_format {
+	IMPORT_NONE,		/* a trigger pack */
+	IMPORT_GTT,		/* GamTextTriggers' triggers */
+	IMPORT_EQ,		/* EQ's own audio triggers */
+};
+
+/* A <logfile>'s <import> */
+struct import {
+	xmlChar *path;
+	enum import_format format;
+	xmlChar *sound_dir;	/* NULL for the directory path is in */
+	int logfile;
+};
 
+/*
+ * Everything loaded from atconfig.xml's <sound>, <trigger> and <logfile>
+ * elements, and from the trigger packs it includes and the trigger files
+ * it imports.  A config is never changed once it is in use: a reload builds
+ * a new one, which the dispatcher swaps in for the old.  The old one is
+ * freed by the dispatcher once nothing refers to it any more: logwatchers,
+ * queued events, playing channels and pending sounds each hold a
+ * reference to the config their sound_id belongs to.
+ */
+struct config {
+	_Atomic int refs;
+	unsigned int generation;
+	struct sound *sounds;
+	int num_sounds;
+	struct trigger *triggers;
+	int num_triggers;
+	struct logfile *logfiles;
+	int num_logfiles;
+	/* the names of the trigger groups, by group_id */
+	xmlChar **group_names;
+	int num_groups;
+	/* atconfig.xml's <include>s and <import>s, while it is being read */
+	xmlChar **includes;
+	int num_includes;
+	struct import *imports;
+	int num_imports;
+	/* the strings belong to the config_files it was put together from */
+	bool borrowed;
+	/* where the arrays and strings are once the config is packed, see pack_config() */
+	char *arena;
+	size_t arena_size;
+	/* or the atconfig.bin they are in instead */
+	void *mapping;
+	size_t mapping_size;
+	struct config *next_retired;
 };
-struct sound *sounds;
 
+/* The current config; only the dispatcher changes it, under config_lock, once it is running */
+static struct config *config;
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+/* lets the logwatchers notice a new config without taking the lock */
+static _Atomic unsigned int config_generation;
 
-static void enqueue_sound(int sound_id)
+/* Returns the current config, with a reference the caller must put_config() */
+static struct config *get_config(void)
 {
-	struct timespec now, elapsed;
-	long elapsed_ms;
-	long min_interval;
+	struct config *cfg;
 
-	if (sound_id == NO_SOUND)
-		return;
+	pthread_mutex_lock(&config_lock);
+	cfg = config;
+	atomic_fetch_add(&cfg->refs, 1);
+	pthread_mutex_unlock(&config_lock);
+	return cfg;
+}
+
+/* Take another reference to a config the caller already holds one to */
+static struct config *hold_config(struct config *cfg)
+{
+	atomic_fetch_add(&cfg->refs, 1);
+	return cfg;
+}
 
-	min_interval = sounds[sound_id].min_interval;
+/* Drop a reference; the dispatcher frees retired configs that have none left */
+static void put_config(struct config *cfg)
+{
+	atomic_fetch_sub(&cfg->refs, 1);
+}
 
-	if (min_interval > 0) {
-		clock_gettime(CLOCK_REALTIME, &now);
-		elapsed = timespec_diff(&now, &(sounds[sound_id].timestamp));
-		elapsed_ms = timespec2ms(&elapsed);
 
-		if (elapsed_ms < min_interval)
-			return;
-	}
+/*
+ * Sound events collected by a logwatcher while it works through a chunk of
+ * log lines.  They are published to the event buffer all at once, so a burst
+ * of matches costs one lock/signal/unlock instead of one per match.
+ */
+struct event_batch {
+	struct event_buffer_entry entry[NUM_EVENTS];
+	int count;
+};
+
+static void publish_events(struct event_batch *batch)
+{
+	int i, next, dropped = 0;
+
+	if (batch->count == 0)
+		return;
 
 	pthread_mutex_lock(&events.lock);
-	if (min_interval > 0)
-		sounds[sound_id].timestamp = now;
-	events.next = (events.next + 1) % NUM_EVENTS;
-	debugmsg("cur = %d, next = %d\n", events.cur, events.next);
-	if (events.next == events.cur) {
-		events.next--;
-		fprintf(stderr, "WARNING: event queue overflow! sound dropped\n");
-	} else {
-		events.entry[events.next].sound_id = sound_id;
+	for (i = 0; i < batch->count; i++) {
+		next = (events.next + 1) % NUM_EVENTS;
+		if (next == events.cur) {
+			dropped = batch->count - i;
+			break;
+		}
+		events.entry[next] = batch->entry[i];
+		events.next = next;
 	}
+	debugmsg("published %d events, cur = %d, next = %d\n", batch->count - dropped, events.cur, events.next);
 	pthread_cond_signal(&events.events_available);
 	pthread_mutex_unlock(&events.lock);
 
+	if (dropped) {
+		fprintf(stderr, "WARNING: event queue overflow! %d sound(s) dropped\n", dropped);
+		for (i = batch->count - dropped; i < batch->count; i++)
+			put_config(batch->entry[i].config);
+	}
+	batch->count = 0;
+}
+
+static void enqueue_sound(struct event_batch *batch, struct config *cfg, int sound_id,
+		int64_t now, time_t log_time)
+{
+	if (sound_id == NO_SOUND)
+		return;
+
+	if (!rate_limit_allow(&cfg->sounds[sound_id].min_interval, now))
+		return;
+
+	if (batch->count == NUM_EVENTS)
+		publish_events(batch);
+	batch->entry[batch->count].config = hold_config(cfg);
+	batch->entry[batch->count].sound_id = sound_id;
+	batch->entry[batch->count].enqueued = now;
+	batch->entry[batch->count].log_time = log_time;
+	batch->count++;
 }
 
-struct trigger {
-	xmlChar *name;
-	xmlChar *pattern;
-	xmlChar *sound_to_play;
-	int sound_to_play_id;
 
+/*
+ * Deduplication of identical alerts seen in several log files, e.g. when
+ * every boxed character sees the same raid emote.  Matches are keyed on the
+ * trigger and the normalized text of the log message, and recorded in a
+ * small open-addressed hash table that the logwatchers share without a lock.
+ * It is best effort: a race or a full table can let a duplicate through,
+ * but it will not suppress an alert that wasn't seen in the window.
+ */
+#define DEDUP_SLOTS 1024	/* must be a power of 2 */
+#define DEDUP_PROBES 8
+
+struct dedup_slot {
+	_Atomic uint64_t key;
+	_Atomic int64_t expires;
 };
-struct trigger *triggers;
+static struct dedup_slot dedup_table[DEDUP_SLOTS];
 
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/* FNV-1a hash of a buffer, carrying on from hash */
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * FNV_PRIME;
+	return hash;
+}
+
+/* FNV-1a hash of a log message, ignoring case and differences in white space */
+static uint64_t hash_log_message(const char *msg)
+{
+	uint64_t hash = FNV_OFFSET_BASIS;
+	bool started = false, space = false;
+
+	for (; *msg; msg++) {
+		if (isspace((unsigned char)*msg)) {
+			space = started;
+			continue;
+		}
+		if (space) {
+			hash = (hash ^ ' ') * FNV_PRIME;
+			space = false;
+		}
+		hash = (hash ^ (unsigned char)toupper((unsigned char)*msg)) * FNV_PRIME;
+		started = true;
+	}
+	return hash;
+}
+
+static uint64_t dedup_key(uint64_t msg_hash, int trigger_id)
+{
+	uint64_t key = msg_hash ^ ((uint64_t)(trigger_id + 1) * 0x9e3779b97f4a7c15ULL);
+
+	/* finalizer from splitmix64, so the low bits used for the slot are well mixed */
+	key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+	key ^= key >> 31;
+	return key ? key : 1;	/* 0 marks an empty slot */
+}
+
+/* Returns true if this key was already recorded less than window_ns ago, otherwise records it */
+static bool dedup_seen(uint64_t key, int64_t now, int64_t window_ns)
+{
+	int i;
+
+	for (i = 0; i < DEDUP_PROBES; i++) {
+		struct dedup_slot *ds = &dedup_table[(key + i) & (DEDUP_SLOTS - 1)];
+		uint64_t slot_key = atomic_load(&ds->key);
+		int64_t expires = atomic_load(&ds->expires);
+
+		if (slot_key != key && slot_key != 0 && expires > now)
+			continue;	/* in use by another message */
+
+		if (slot_key != key) {
+			/* empty or stale, try to take it over */
+			if (!atomic_compare_exchange_strong(&ds->key, &slot_key, key)) {
+				if (slot_key == key)
+					return true;	/* the same message, from another log file, just now */
+				continue;
+			}
+			atomic_store(&ds->expires, now + window_ns);
+			return false;
+		}
+
+		do {
+			if (expires > now)
+				return true;
+		} while (!atomic_compare_exchange_weak(&ds->expires, &expires, now + window_ns));
+		return false;
+	}
+	/* table is crowded here, err on the side of playing the sound */
+	return false;
+}
+
+/* msg_hash caches the message hash across the triggers matching one line, 0 = not computed yet */
+static bool is_duplicate(const struct trigger *trigger, int trigger_id, const char *msg,
+		uint64_t *msg_hash, int64_t now)
+{
+	if (trigger->dedup_window_ns <= 0)
+		return false;
+	if (*msg_hash == 0)
+		*msg_hash = hash_log_message(msg);
+	return dedup_seen(dedup_key(*msg_hash, trigger_id), now, trigger->dedup_window_ns);
+}
+
+
+static void apply_thread_settings(const struct thread_settings *ts, const char *thread_name)
+{
+	struct sched_param param;
+	int ret;
+
+	if (ts->policy != SCHED_OTHER) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = ts->priority;
+		ret = pthread_setschedparam(pthread_self(), ts->policy, &param);
+		if (ret != 0) {
+			fprintf(stderr, "WARNING: unable to set the scheduling policy of the %s thread: %s\n",
+					thread_name, strerror(ret));
+		}
+	}
+	if (ts->set_nice) {
+#ifdef __linux__
+		/* On Linux the nice value is per thread, not per process */
+		ret = setpriority(PRIO_PROCESS, syscall(SYS_gettid), ts->nice);
+#else
+		ret = -1;
+		errno = ENOSYS;
+#endif
+		if (ret < 0) {
+			fprintf(stderr, "WARNING: unable to set the nice value of the %s thread: %s\n",
+					thread_name, strerror(errno));
+		}
+	}
+#ifdef CPU_SETSIZE
+	if (ts->set_cpus) {
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &ts->cpus);
+		if (ret != 0) {
+			fprintf(stderr, "WARNING: unable to set the CPU affinity of the %s thread: %s\n",
+					thread_name, strerror(ret));
+		}
+	}
+#endif
+}
 
 #ifdef __CYGWIN__
 #define POS_VAL(pos) pos
 #else
 #define POS_VAL(pos) pos.__pos
 #endif
-/* This function works similar to the "tail -f" command */
-static void tail_follow(FILE *log_file, off_t *cur_size, char **buffer, size_t *buffer_size)
+/*
+ * This function works similar to the "tail -f" command.  Returns false,
+ * without a line, if stop is set or a config other than generation is
+ * installed while it is waiting for one.
+ */
+static bool tail_follow(FILE *log_file, off_t *cur_size, char **buffer, size_t *buffer_size,
+		_Atomic bool *stop, unsigned int generation)
 {
 	int ret;
 	fpos_t pos;
@@ -219,7 +791,7 @@ static void tail_follow(FILE *log_file, off_t *cur_size, char **buffer, size_t *
 	/* the first time through, the next test will be false since cur_size == -1 */
 	if (POS_VAL(pos) < *cur_size) {
 		getline(buffer, buffer_size, log_file);
-		return;
+		return true;
 	}
 	while (1) {
 		/* See if there's any new data since the last time we checked */
@@ -241,8 +813,10 @@ static void tail_follow(FILE *log_file, off_t *cur_size, char **buffer, size_t *
 					debugmsg("cur_size = %" PRId64 ", pos = %" PRId64 "\n",
 							*cur_size,
 							POS_VAL(pos));
-					return;
+					return true;
 				} else {
+					if (atomic_load(stop) || atomic_load(&config_generation) != generation)
+						return false;
 					/* wait for 10 msec */
 					usleep(10 * 1000);
 				}
@@ -251,620 +825,3966 @@ static void tail_follow(FILE *log_file, off_t *cur_size, char **buffer, size_t *
 	}
 }
 
+/* Returns true if the last tail_follow() left lines that can be read without waiting */
+static bool tail_has_more(FILE *log_file, off_t cur_size)
+{
+	fpos_t pos;
+
+	fgetpos(log_file, &pos);
+	return POS_VAL(pos) < cur_size;
+}
+
 /* Before character 27 of every log line is just the time stamp, so skip it */
 #define LOG_MSG_START 27
 
+/* Parse the "[Sun Feb 24 19:10:33 2013] " time stamp at the start of a log line */
+static time_t log_line_time(const char *line)
+{
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if (line[0] != '[' || strptime(&line[1], "%a %b %d %H:%M:%S %Y]", &tm) == NULL)
+		return (time_t)-1;
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+/* The index of a log file in a config, or -1 if it isn't in it */
+static int find_logfile(const struct config *cfg, const xmlChar *name)
+{
+	int i;
+
+	for (i = 0; i < cfg->num_logfiles; i++) {
+		if (xmlStrEqual(cfg->logfiles[i].file, name))
+			return i;
+	}
+	return -1;
+}
+
+/* Carry the active groups of a log over to a new config, by name */
+static uint64_t map_active_groups(const struct config *from, const struct config *to, uint64_t active)
+{
+	uint64_t mapped = 0;
+	int i, j;
+
+	for (i = 0; i < from->num_groups; i++) {
+		if (!(active & (1ULL << i)))
+			continue;
+		for (j = 0; j < to->num_groups; j++) {
+			if (xmlStrEqual(from->group_names[i], to->group_names[j]))
+				mapped |= 1ULL << j;
+		}
+	}
+	return mapped;
+}
+
 void *logwatcher(void *arg) {
-	intptr_t log_file_num = (intptr_t)arg;
+	struct log_file_info *lw = arg;
+	struct config *cfg = get_config(), *new_cfg;
+	struct logfile *logfile;
+	const struct trigger_table *table;
+	struct table_variants variants = { .count = 0 };
+	uint64_t active_groups = 0, groups;
 	int i, ret;
+	bool got_line;
 	size_t buffer_size = 1024;
 	off_t cur_size = -1;
 	char *buffer;
+	struct event_batch batch = { .count = 0 };
+	struct folded_line line = { .text = NULL, .size = 0 };
+
+	apply_thread_settings(&runtime.logwatcher, "logwatcher");
 
 	buffer = malloc(buffer_size);
-	ret = fseek(lfi[log_file_num].file, 0, SEEK_END);
+	ret = fseek(lw->file, 0, SEEK_END);
 	if (ret < 0) {
 		fprintf(stderr, "Unable to seek to end of log file: %s\n",
 				strerror(errno));
 		exit(1);
 	}
+	/* a reload may have dropped the log file before this thread got its config */
+	i = find_logfile(cfg, lw->name);
+	if (i < 0)
+		goto stopped;
+	logfile = &cfg->logfiles[i];
+	table = select_trigger_table(&variants, &logfile->table, active_groups);
 	while (1) {
-		tail_follow(lfi[log_file_num].file, &cur_size, &buffer, &buffer_size);
+		got_line = tail_follow(lw->file, &cur_size, &buffer, &buffer_size, &lw->stop, cfg->generation);
+		if (atomic_load(&lw->stop))
+			break;
+		/* pick up a reloaded config between lines, or while waiting for one */
+		if (atomic_load(&config_generation) != cfg->generation) {
+			new_cfg = get_config();
+			active_groups = map_active_groups(cfg, new_cfg, active_groups);
+			free_table_variants(&variants);
+			put_config(cfg);
+			cfg = new_cfg;
+			/* stop was set before the config that dropped the log file was installed */
+			i = find_logfile(cfg, lw->name);
+			if (i < 0)
+				break;
+			logfile = &cfg->logfiles[i];
+			table = select_trigger_table(&variants, &logfile->table, active_groups);
+		}
+		if (!got_line)
+			continue;
 		/* chomp off the newline */
 		buffer[strlen(buffer) - 1] = '\0';
 		debugmsg("got line: %s\n", buffer);
 		if (strlen(buffer) > LOG_MSG_START) {
-			for (i = 0; i < logfiles[log_file_num].num_attached_triggers; i++) {
-				int trigger_id = logfiles[log_file_num].attached_triggers[i].trigger_id;
-				debugmsg("looking for %s in %s\n", triggers[trigger_id].pattern, buffer);
-				if (case_insensitive_strstr(&buffer[LOG_MSG_START], (char *)triggers[trigger_id].pattern)) {
-					debugmsg("enqueuing sound %s\n", triggers[trigger_id].name);
-					enqueue_sound(triggers[trigger_id].sound_to_play_id);
-					if (logfiles[log_file_num].attached_triggers[i].stop_search_on_match)
+			/* only computed once something on this line needs to be enqueued */
+			time_t log_time = (time_t)-1;
+			uint64_t msg_hash = 0;
+
+			groups = active_groups;
+			fold_line(&line, &buffer[LOG_MSG_START]);
+			for (i = 0; i < table->count; i++) {
+				if (trigger_table_match(table, i, &line)) {
+					struct attached_trigger *at = &logfile->attached_triggers[table->attached[i]];
+					struct trigger *trigger = &cfg->triggers[table->trigger_id[i]];
+					int64_t now = now_ns();
+
+					/* takes effect from the next line on */
+					groups = (groups & ~trigger->disables) | trigger->enables;
+
+					/*
+					 * Check the most specific limit first, so that a match
+					 * dropped by it doesn't use up the broader buckets.
+					 */
+					if (table->sound_id[i] == NO_SOUND) {
+						/* nothing to play, so nothing to rate limit */
+					} else if (is_duplicate(trigger, table->trigger_id[i], &buffer[LOG_MSG_START], &msg_hash, now)) {
+						debugmsg("duplicate of a recent match for trigger %s\n", trigger->name);
+					} else if (!rate_limit_allow(&at->rate_limit, now) ||
+					    !rate_limit_allow(&trigger->rate_limit, now) ||
+					    !rate_limit_allow(&logfile->rate_limit, now)) {
+						debugmsg("rate limited trigger %s\n", trigger->name);
+					} else {
+						debugmsg("enqueuing sound %s\n", trigger->name);
+						if (log_time == (time_t)-1)
+							log_time = log_line_time(buffer);
+						enqueue_sound(&batch, cfg, table->sound_id[i], now, log_time);
+					}
+					if (table->stop_search_on_match[i])
 						break;
 				}
 			}
+			if (groups != active_groups) {
+				debugmsg("active trigger groups in %s are now %" PRIx64 "\n", lw->name, groups);
+				active_groups = groups;
+				table = select_trigger_table(&variants, &logfile->table, active_groups);
+			}
 		}
+		/* Publish what this chunk of the log produced before waiting for more */
+		if (!tail_has_more(lw->file, cur_size))
+			publish_events(&batch);
 	}
+
+	/* the log file was dropped from the config */
+stopped:
+	debugmsg("stopped watching %s\n", lw->name);
+	publish_events(&batch);
+	free_table_variants(&variants);
+	put_config(cfg);
+	fclose(lw->file);
+	xmlFree(lw->name);
+	free(lw);
+	free(buffer);
+	free(line.text);
+	return NULL;
 }
 
-int find_free_channel(void)
+/* Returns true if an event has outlived its sound's max_age and should be discarded */
+static bool event_expired(const struct event_buffer_entry *event)
 {
-	FMOD_BOOL is_playing;
-	FMOD_RESULT result;
-	int i;
+	struct sound *sound = &event->config->sounds[event->sound_id];
+	long max_age = sound->max_age;
+	long waited_ms;
+
+	if (max_age <= 0)
+		return false;
+
+	waited_ms = (now_ns() - event->enqueued) / NS_IN_MS;
+	if (waited_ms > max_age) {
+		fprintf(stderr, "WARNING: sound %s waited %ld ms to play, dropping it\n",
+				sound->name, waited_ms);
+		return true;
+	}
+	/*
+	 * Catch lines that were already old when the logwatcher read them.  Log
+	 * time stamps only have a resolution of one second, so allow for that.
+	 */
+	if (event->log_time != (time_t)-1) {
+		long log_age_ms = (long)(time(NULL) - event->log_time) * 1000;
 
-	for (i = 0; i < NUM_CHANNELS; i++) {
-		if (channel[i] == NULL) {
-			return i;
-		};
-		result = FMOD_Channel_IsPlaying(channel[i], &is_playing);
-		ERRCHECK(result);
-		if (!is_playing) {
-			return i;
+		if (log_age_ms > max_age + 1000) {
+			fprintf(stderr, "WARNING: sound %s is for a log line %ld s old, dropping it\n",
+					sound->name, log_age_ms / 1000);
+			return true;
 		}
 	}
-	return -1;
+	return false;
 }
 
-#define CONFIG_XML "atconfig.xml"
-#define CONFIG_SCHEMA "../XML/AudioTriggers.xsd"
-
-/* the text element is a pseudo element defined by libxml */
-#define TEXT_ELT			(xmlChar *)"text"
-
-#define AUDIOTRIGGERS_ELT		(xmlChar *)"audiotriggers"
+static void init_channel_slots(void)
+{
+	int i;
 
-#define SOUND_ELT 			(xmlChar *)"sound"
-#define SOUND_NAME_ATTR 		(xmlChar *)"name"
-#define SOUND_FILE_ELT 			(xmlChar *)"file"
-#define SOUND_VOL_ELT 			(xmlChar *)"vol"
-#define SOUND_PAN_ELT 			(xmlChar *)"pan"
-#define SOUND_PRIO_ELT 			(xmlChar *)"priority"
-#define SOUND_MIN_INTERVAL_ELT	(xmlChar *)"min_interval"
+	/* one slot for every channel FMOD can hand out, virtual or not */
+	num_channel_slots = audio.virtual_voices;
+	channel_slots = malloc(sizeof(struct channel_slot) * num_channel_slots);
+	free_slots = malloc(sizeof(int) * num_channel_slots);
+	for (i = 0; i < num_channel_slots; i++) {
+		channel_slots[i].channel = NULL;
+		channel_slots[i].generation = 0;
+		channel_slots[i].in_use = false;
+		/* hand out the low numbered slots first */
+		free_slots[i] = num_channel_slots - 1 - i;
+	}
+	num_free_slots = num_channel_slots;
+}
 
-#define TRIGGER_ELT 			(xmlChar *)"trigger"
-#define TRIGGER_NAME_ATTR 		(xmlChar *)"name"
-#define TRIGGER_PATTERN_ELT		(xmlChar *)"pattern"
-#define TRIGGER_SOUNDTOPLAY_ELT		(xmlChar *)"sound_to_play"
-#define TRIGGER_COMMENT_ELT		(xmlChar *)"comment"
+static void release_channel_slot(int slot)
+{
+	struct sound *sound;
 
-#define LOGFILE_ELT			(xmlChar *)"logfile"
-#define LOGFILE_FILE_ELT 		(xmlChar *)"file"
-#define LOGFILE_ATTACHTRIGGER_ELT	(xmlChar *)"attach_trigger"
-#define LOGFILE_ATTACHTRIGGER_STOPSEARCHONMATCH_ELT	(xmlChar *)"stop_search_on_match"
-#define LOGFILE_ATTACHTRIGGER_NAME_ATTR	(xmlChar *)"name"
+	if (!channel_slots[slot].in_use)
+		return;
+	sound = &channel_slots[slot].config->sounds[channel_slots[slot].sound_id];
+	sound->num_playing--;
+	sound_data[sound->data_id].num_playing--;
+	put_config(channel_slots[slot].config);
+	channel_slots[slot].in_use = false;
+	channel_slots[slot].channel = NULL;
+	channel_slots[slot].generation++;
+	free_slots[num_free_slots++] = slot;
+}
 
-/* This code is from http://wiki.njh.eu/XML-Schema_validation_with_libxml2 */
-static int is_valid(const xmlDocPtr doc, const char *schema_filename)
+static FMOD_RESULT F_CALLBACK channel_callback(FMOD_CHANNEL *chan, FMOD_CHANNEL_CALLBACKTYPE type,
+		void *commanddata1, void *commanddata2)
 {
-	xmlDocPtr schema_doc = xmlReadFile(schema_filename, NULL,
-			XML_PARSE_NONET);
-	if (schema_doc == NULL) {
-		/* the schema cannot be loaded or is not well-formed */
-		fprintf(stderr, "Error: Unable to load the schema file \"%s\"\n",
-				schema_filename);
-		exit(1);
-	}
-	xmlSchemaParserCtxtPtr parser_ctxt = xmlSchemaNewDocParserCtxt(
-			schema_doc);
-	if (parser_ctxt == NULL) {
-		/* unable to create a parser context for the schema */
-		xmlFreeDoc(schema_doc);
-		return -2;
-	}
-	xmlSchemaPtr schema = xmlSchemaParse(parser_ctxt);
-	if (schema == NULL) {
-		/* the schema itself is not valid */
-		xmlSchemaFreeParserCtxt(parser_ctxt);
-		xmlFreeDoc(schema_doc);
-		return -3;
-	}
-	xmlSchemaValidCtxtPtr valid_ctxt = xmlSchemaNewValidCtxt(schema);
-	if (valid_ctxt == NULL) {
-		/* unable to create a validation context for the schema */
-		xmlSchemaFree(schema);
-		xmlSchemaFreeParserCtxt(parser_ctxt);
-		xmlFreeDoc(schema_doc);
-		return -4;
+	void *userdata;
+	uintptr_t handle;
+	int slot;
+
+	if (type != FMOD_CHANNEL_CALLBACKTYPE_END)
+		return FMOD_OK;
+	if (FMOD_Channel_GetUserData(chan, &userdata) != FMOD_OK)
+		return FMOD_OK;
+
+	handle = (uintptr_t)userdata;
+	slot = handle & ((1 << SLOT_BITS) - 1);
+	if (slot < num_channel_slots && channel_slots[slot].in_use &&
+	    channel_slots[slot].generation == (unsigned int)(handle >> SLOT_BITS)) {
+		debugmsg("channel slot %d finished\n", slot);
+		release_channel_slot(slot);
 	}
-	int is_valid = (xmlSchemaValidateDoc(valid_ctxt, doc) == 0);
-	xmlSchemaFreeValidCtxt(valid_ctxt);
-	xmlSchemaFree(schema);
-	xmlSchemaFreeParserCtxt(parser_ctxt);
-	xmlFreeDoc(schema_doc);
-	/* force the return value to be non-negative on success */
-	return is_valid ? 1 : 0;
+	return FMOD_OK;
 }
 
-static void open_config_xml(xmlDocPtr *doc)
+/*
+ * Safety net for slots whose END callback never came, e.g. because FMOD
+ * reused a channel before reporting its end: ask FMOD about every slot.
+ * Errors mean the handle is stale.  This costs a call per slot, so the
+ * dispatcher only does it now and then, while the free list is empty.
+ */
+#define RECLAIM_INTERVAL_MS 1000
+static void reclaim_channel_slots(void)
 {
-	*doc = xmlParseFile(CONFIG_XML);
-	if (*doc == NULL) {
-		fprintf(stderr, "Error: unable to parse file \"%s\"\n",
-				CONFIG_XML);
-		exit(1);
-	}
-	if (! is_valid(*doc, CONFIG_SCHEMA)) {
-		fprintf(stderr, "Error: one or more validation errors in the config file \"%s\"\n",
-				CONFIG_XML);
-		exit(1);
+	FMOD_BOOL is_playing;
+	int i;
+
+	for (i = 0; i < num_channel_slots; i++) {
+		if (!channel_slots[i].in_use)
+			continue;
+		if (FMOD_Channel_IsPlaying(channel_slots[i].channel, &is_playing) != FMOD_OK || !is_playing) {
+			debugmsg("reclaimed channel slot %d\n", i);
+			release_channel_slot(i);
+		}
 	}
 }
 
-typedef void (*foreach_cb)(xmlNodePtr node);
-
-static void foreach_sibling(xmlNodePtr node, const xmlChar *element, foreach_cb cb)
+/*
+ * Returns a free channel slot, or -1 if every channel is busy.  The
+ * dispatcher's periodic update delivers the END callbacks that refill the
+ * free list, so this never calls into FMOD.
+ */
+static int alloc_channel_slot(void)
 {
-	xmlNodePtr sib;
+	if (num_free_slots == 0)
+		return -1;
+	return free_slots[--num_free_slots];
+}
 
-	for (sib = node; sib; sib = sib->next) {
-		debugmsg("node->name: %s\n", sib->name);
-		if (xmlStrEqual(sib->name, element))
-			cb(sib);
-	}
+/* Stops the sound in a slot to make room for another one, and returns the slot */
+static int steal_channel_slot(int slot)
+{
+	debugmsg("stealing channel slot %d from sound %s\n", slot,
+			channel_slots[slot].config->sounds[channel_slots[slot].sound_id].name);
+	/* the END callback may or may not run from inside the stop */
+	FMOD_Channel_Stop(channel_slots[slot].channel);
+	release_channel_slot(slot);
+	/* it was just pushed on top of the free list */
+	num_free_slots--;
+	return slot;
 }
 
-static xmlNodePtr get_element(xmlNodePtr node, const xmlChar *element)
+/* The oldest channel playing sound_id */
+static int oldest_instance(const struct config *cfg, int sound_id)
 {
-	xmlNodePtr sib;
+	int i, victim = -1;
 
-	for (sib = node; sib; sib = sib->next) {
-		if (xmlStrEqual(sib->name, element))
-			return sib;
+	for (i = 0; i < num_channel_slots; i++) {
+		if (channel_slots[i].in_use && channel_slots[i].config == cfg &&
+		    channel_slots[i].sound_id == sound_id &&
+		    (victim == -1 || channel_slots[i].started < channel_slots[victim].started))
+			victim = i;
 	}
-	return NULL;
+	return victim;
 }
 
-/* Find an element among siblings, and get the (one) text element within it */
-static xmlNodePtr get_element_text(xmlNodePtr node, const xmlChar *element)
+/*
+ * Pick the channel to cut off when all are busy, according to the
+ * <voice_stealing> policy.  Only sounds that are no more important than
+ * the new one (by FMOD priority, where 0 is the most important) are
+ * candidates, so low priority spam can never cut off a critical alert.
+ */
+static int pick_victim(int prio)
 {
-	xmlNodePtr sib;
+	float audibility, victim_audibility = 0;
+	struct channel_slot *cs, *vs;
+	int i, victim = -1;
 
-	for (sib = node; sib; sib = sib->next) {
-		if (xmlStrEqual(sib->name, element)) {
-			xmlNodePtr text;
-			text = get_element(sib->children, TEXT_ELT);
-			if (text == NULL) {
-				fprintf(stderr, "unable to find text element for %s\n", (char *)element);
-			} else {
-				return text;
+	for (i = 0; i < num_channel_slots; i++) {
+		cs = &channel_slots[i];
+		if (!cs->in_use || cs->prio < prio)
+			continue;
+		if (audio.voice_stealing == STEAL_QUIETEST) {
+			if (FMOD_Channel_GetAudibility(cs->channel, &audibility) != FMOD_OK)
+				audibility = 0;
+			if (victim == -1 || audibility < victim_audibility) {
+				victim = i;
+				victim_audibility = audibility;
 			}
+			continue;
+		}
+		if (victim == -1) {
+			victim = i;
+			continue;
+		}
+		vs = &channel_slots[victim];
+		if (audio.voice_stealing == STEAL_PRIORITY && cs->prio != vs->prio) {
+			if (cs->prio > vs->prio)
+				victim = i;
+		} else if (cs->started < vs->started) {
+			victim = i;
 		}
 	}
-	return NULL;
+	return victim;
 }
 
-void process_sound_element(xmlNodePtr node)
+/* The <sound>'s own priority, or else its file's */
+static int sound_prio(const struct sound *sound)
 {
-	xmlNodePtr children = node->children, file, vol, pan, prio, min_interval;
-	static int sound_cntr = 0;
+	if (sound->prio != USE_DEFAULT_PRIO)
+		return sound->prio;
+	return sound_data[sound->data_id].prio;
+}
 
-	sounds[sound_cntr].name = xmlGetProp(node, SOUND_NAME_ATTR);
-	if (sounds[sound_cntr].name == NULL) {
-		fprintf(stderr, "Unable to find name attribute on sound element %d\n", sound_cntr + 1);
-		exit(1);
-	}
+static void play_sound(FMOD_SYSTEM *system, struct config *cfg, int sound_id)
+{
+	struct sound *sound = &cfg->sounds[sound_id];
+	struct sound_data *data = &sound_data[sound->data_id];
+	struct channel_slot *cs;
+	FMOD_SOUND *fmod_sound = data->fmod_sound;
+	FMOD_RESULT result;
+	int slot, victim;
 
-	file = get_element_text(children, SOUND_FILE_ELT);
-	if (file == NULL) {
-		fprintf(stderr, "Unable to find file element in sound element %d\n", sound_cntr + 1);
-		exit(1);
+	if (data->state != SOUND_READY) {
+		if (data->state == SOUND_LOADING)
+			fprintf(stderr, "Sound %s is still loading, playing a beep instead\n", sound->name);
+		fmod_sound = default_beep;
 	}
-	sounds[sound_cntr].file = xmlStrdup(file->content);
 
-	vol = get_element_text(children, SOUND_VOL_ELT);
-	if (vol != NULL) {
-		debugmsg("vol->content : %s\n", vol->content);
-		sscanf((char *)vol->content, "%f", &sounds[sound_cntr].vol);
+	if (sound->max_polyphony > 0 &&
+	    sound->num_playing >= sound->max_polyphony &&
+	    (victim = oldest_instance(cfg, sound_id)) != -1) {
+		/* replace the oldest copy of this sound */
+		slot = steal_channel_slot(victim);
 	} else {
-		sounds[sound_cntr].vol = USE_DEFAULT;
+		slot = alloc_channel_slot();
 	}
-
-	pan = get_element_text(children, SOUND_PAN_ELT);
-	if (pan != NULL) {
-		sscanf((char *)pan->content, "%f", &sounds[sound_cntr].pan);
-	} else {
-		sounds[sound_cntr].pan = USE_DEFAULT;
+	if (slot == -1 && audio.voice_stealing != STEAL_NONE) {
+		victim = pick_victim(sound_prio(sound));
+		if (victim != -1)
+			slot = steal_channel_slot(victim);
 	}
-
-	prio = get_element_text(children, SOUND_PRIO_ELT);
-	if (prio != NULL) {
-		sscanf((char *)prio->content, "%d", &sounds[sound_cntr].prio);
-	} else {
-		sounds[sound_cntr].prio = USE_DEFAULT_PRIO;
+	if (slot == -1) {
+		fprintf(stderr, "WARNING: No free channels! Dropping sound %s\n", sound->name);
+		return;
 	}
+	cs = &channel_slots[slot];
 
-	min_interval = get_element_text(children, SOUND_MIN_INTERVAL_ELT);
-	if (min_interval != NULL) {
-		sscanf((char *)min_interval->content, "%ld", &sounds[sound_cntr].min_interval);
-	} else {
-		sounds[sound_cntr].min_interval = 0;
+	/* start paused, so the callback is in place before the sound can end */
+	result = FMOD_System_PlaySound(system, FMOD_CHANNEL_FREE, fmod_sound, 1, &cs->channel);
+	if (result != FMOD_OK) {
+		fprintf(stderr, "WARNING: unable to play sound %s: %s\n", sound->name, FMOD_ErrorString(result));
+		free_slots[num_free_slots++] = slot;
+		return;
+	}
+	cs->in_use = true;
+	cs->config = hold_config(cfg);
+	cs->sound_id = sound_id;
+	cs->prio = sound_prio(sound);
+	cs->started = now_ns();
+	sound->num_playing++;
+	data->num_playing++;
+	/* the sound data may be shared, so the <sound>'s settings go on the channel */
+	FMOD_Channel_SetVolume(cs->channel, sound->vol != USE_DEFAULT ? sound->vol : data->vol);
+	FMOD_Channel_SetPan(cs->channel, sound->pan != USE_DEFAULT ? sound->pan : data->pan);
+	FMOD_Channel_SetPriority(cs->channel, cs->prio);
+	FMOD_Channel_SetUserData(cs->channel,
+			(void *)(((uintptr_t)cs->generation << SLOT_BITS) | slot));
+	FMOD_Channel_SetCallback(cs->channel, channel_callback);
+	result = FMOD_Channel_SetPaused(cs->channel, 0);
+	if (result != FMOD_OK) {
+		fprintf(stderr, "WARNING: unable to start sound: %s\n", FMOD_ErrorString(result));
+		FMOD_Channel_Stop(cs->channel);
+		release_channel_slot(slot);
 	}
-	sounds[sound_cntr].timestamp.tv_sec = 0;
-	sounds[sound_cntr].timestamp.tv_nsec = 0;
-
-	sound_cntr++;
 }
 
+#define CONFIG_XML "atconfig.xml"
+#define CONFIG_SCHEMA "../XML/AudioTriggers.xsd"
 
-static void count_sound_elements(xmlNodePtr node) {
-	num_sounds++;
-}
+/* the text element is a pseudo element defined by libxml */
 
-static void count_trigger_elements(xmlNodePtr node) {
-	num_triggers++;
-}
+#define AUDIOTRIGGERS_ELT		(xmlChar *)"audiotriggers"
 
-static void count_logfile_elements(xmlNodePtr node) {
-	num_logfiles++;
-}
+#define SOUND_ELT 			(xmlChar *)"sound"
+#define SOUND_NAME_ATTR 		(xmlChar *)"name"
+#define SOUND_FILE_ELT 			(xmlChar *)"file"
+#define SOUND_VOL_ELT 			(xmlChar *)"vol"
+#define SOUND_PAN_ELT 			(xmlChar *)"pan"
+#define SOUND_PRIO_ELT 			(xmlChar *)"priority"
+#define SOUND_MIN_INTERVAL_ELT	(xmlChar *)"min_interval"
+#define SOUND_MAX_AGE_ELT		(xmlChar *)"max_age"
+#define SOUND_MAX_POLYPHONY_ELT		(xmlChar *)"max_polyphony"
+#define SOUND_STORAGE_ELT		(xmlChar *)"storage"
+#define SOUND_PRELOAD_ELT		(xmlChar *)"preload"
 
-static void load_sounds_from_config(xmlNodePtr node)
-{
-	foreach_sibling(node, SOUND_ELT, count_sound_elements);
-	sounds = malloc(sizeof(struct sound) * num_sounds);
+#define RATE_LIMIT_ELT			(xmlChar *)"rate_limit"
+#define RATE_LIMIT_BURST_ELT		(xmlChar *)"burst"
+#define RATE_LIMIT_INTERVAL_ELT		(xmlChar *)"interval"
+
+#define TRIGGER_ELT 			(xmlChar *)"trigger"
+#define TRIGGER_NAME_ATTR 		(xmlChar *)"name"
+#define TRIGGER_PATTERN_ELT		(xmlChar *)"pattern"
+#define TRIGGER_SOUNDTOPLAY_ELT		(xmlChar *)"sound_to_play"
+#define TRIGGER_COMMENT_ELT		(xmlChar *)"comment"
+#define TRIGGER_DEDUPWINDOW_ELT		(xmlChar *)"dedup_window"
+#define TRIGGER_GROUP_ELT		(xmlChar *)"group"
+#define TRIGGER_ENABLEGROUPS_ELT	(xmlChar *)"enable_groups"
+#define TRIGGER_DISABLEGROUPS_ELT	(xmlChar *)"disable_groups"
+
+#define INCLUDE_ELT			(xmlChar *)"include"
+#define IMPORT_FORMAT_ATTR		(xmlChar *)"format"
+#define IMPORT_SOUNDDIR_ATTR		(xmlChar *)"sound_dir"
+#define TRIGGER_PACK_ELT		(xmlChar *)"trigger_pack"
 
-	foreach_sibling(node, SOUND_ELT, process_sound_element);
+#define LOGFILE_ELT			(xmlChar *)"logfile"
+#define LOGFILE_FILE_ELT 		(xmlChar *)"file"
+#define LOGFILE_ATTACHTRIGGER_ELT	(xmlChar *)"attach_trigger"
+#define LOGFILE_ATTACHTRIGGER_STOPSEARCHONMATCH_ELT	(xmlChar *)"stop_search_on_match"
+#define LOGFILE_ATTACHTRIGGER_NAME_ATTR	(xmlChar *)"name"
+#define LOGFILE_IMPORT_ELT		(xmlChar *)"import"
+
+#define AUDIO_ELT			(xmlChar *)"audio"
+#define AUDIO_UPDATEINTERVAL_ELT	(xmlChar *)"update_interval"
+#define AUDIO_VOICESTEALING_ELT		(xmlChar *)"voice_stealing"
+#define AUDIO_CHANNELS_ELT		(xmlChar *)"channels"
+#define AUDIO_VIRTUALVOICES_ELT		(xmlChar *)"virtual_voices"
+#define AUDIO_OUTPUT_ELT		(xmlChar *)"output"
+#define AUDIO_DRIVERARGUMENTS_ELT	(xmlChar *)"driver_arguments"
+#define AUDIO_SAMPLERATE_ELT		(xmlChar *)"sample_rate"
+#define AUDIO_DSPBUFFERLENGTH_ELT	(xmlChar *)"dsp_buffer_length"
+#define AUDIO_DSPNUMBUFFERS_ELT		(xmlChar *)"dsp_num_buffers"
+#define AUDIO_SOUNDMEMORYBUDGET_ELT	(xmlChar *)"sound_memory_budget"
+#define AUDIO_STREAMTHRESHOLD_ELT	(xmlChar *)"stream_threshold"
+#define AUDIO_SOUNDCACHESIZE_ELT	(xmlChar *)"sound_cache_size"
+#define AUDIO_SOUNDBANK_ELT		(xmlChar *)"sound_bank"
+
+static const struct {
+	const char *name;
+	FMOD_OUTPUTTYPE type;
+} output_types[] = {
+	{ "auto",	FMOD_OUTPUTTYPE_AUTODETECT },
+	{ "nosound",	FMOD_OUTPUTTYPE_NOSOUND },
+	{ "wavwriter",	FMOD_OUTPUTTYPE_WAVWRITER },
+	{ "dsound",	FMOD_OUTPUTTYPE_DSOUND },
+	{ "winmm",	FMOD_OUTPUTTYPE_WINMM },
+	{ "wasapi",	FMOD_OUTPUTTYPE_WASAPI },
+	{ "asio",	FMOD_OUTPUTTYPE_ASIO },
+	{ "oss",	FMOD_OUTPUTTYPE_OSS },
+	{ "alsa",	FMOD_OUTPUTTYPE_ALSA },
+	{ "esd",	FMOD_OUTPUTTYPE_ESD },
+	{ "pulseaudio",	FMOD_OUTPUTTYPE_PULSEAUDIO },
+};
+#define NUM_OUTPUT_TYPES (sizeof(output_types) / sizeof(output_types[0]))
+
+#define RUNTIME_ELT			(xmlChar *)"runtime"
+#define RUNTIME_DISPATCHER_ELT		(xmlChar *)"dispatcher"
+#define RUNTIME_LOGWATCHER_ELT		(xmlChar *)"logwatcher"
+#define RUNTIME_DEDUPWINDOW_ELT		(xmlChar *)"dedup_window"
+#define THREAD_SCHEDULING_ELT		(xmlChar *)"scheduling"
+#define THREAD_PRIORITY_ELT		(xmlChar *)"priority"
+#define THREAD_NICE_ELT			(xmlChar *)"nice"
+#define THREAD_CPUS_ELT			(xmlChar *)"cpus"
+
+/* The config being loaded; the process_*_element() functions fill it in */
+static struct config *loading;
+/* The file being read */
+static const char *reading_file;
+/* While reloading, errors in atconfig.xml jump back here instead of exiting */
+static jmp_buf *config_error_jmp;
+
+static void config_error(void)
+{
+	if (config_error_jmp != NULL)
+		longjmp(*config_error_jmp, 1);
+	exit(1);
 }
 
-void process_trigger_element(xmlNodePtr node)
+/*
+ * atconfig.xml is read in a single pass with an xmlTextReader, which
+ * validates it against the schema as it goes, and each element is stored
+ * as soon as it has been read.  The schema fixes the order of the top
+ * level elements, so <runtime> is always seen before the triggers that
+ * default to its dedup_window.  The trigger packs it includes and the
+ * files it imports are read once it has been, one at a time.
+ */
+static bool config_xml_error_printed;
+
+static void print_config_xml_error(void *arg, xmlErrorPtr error)
 {
-	static int trigger_cntr = 0;
-	xmlNodePtr children = node->children, pattern, sound_to_play;
+	fprintf(stderr, "%s:%d: %s", error->file ? error->file : reading_file, error->line, error->message);
+	config_xml_error_printed = true;
+}
 
-	debugmsg("processing trigger element: %s\n", node->name);
+/* Compiled on the first load, and kept for reloads */
+static xmlSchemaPtr config_schema;
 
-	/* Note that there is a comment element too, but it is ignored by this code */
+static xmlSchemaPtr load_config_schema(void)
+{
+	xmlSchemaParserCtxtPtr parser_ctxt;
 
-	triggers[trigger_cntr].name = xmlGetProp(node, TRIGGER_NAME_ATTR);
-	if (triggers[trigger_cntr].name == NULL) {
-		fprintf(stderr, "Unable to find name attribute on trigger element %d\n", trigger_cntr + 1);
-		exit(1);
+	if (config_schema != NULL)
+		return config_schema;
+	parser_ctxt = xmlSchemaNewParserCtxt(CONFIG_SCHEMA);
+	if (parser_ctxt != NULL) {
+		config_schema = xmlSchemaParse(parser_ctxt);
+		xmlSchemaFreeParserCtxt(parser_ctxt);
 	}
-
-	pattern = get_element_text(children, TRIGGER_PATTERN_ELT);
-	if (pattern == NULL) {
-		fprintf(stderr, "Unable to find pattern element in trigger element %d\n", trigger_cntr + 1);
-		exit(1);
+	if (config_schema == NULL) {
+		fprintf(stderr, "Error: Unable to load the schema file \"%s\"\n", CONFIG_SCHEMA);
+		config_error();
 	}
-	triggers[trigger_cntr].pattern = xmlStrdup(pattern->content);
+	return config_schema;
+}
 
-	sound_to_play = get_element_text(children, TRIGGER_SOUNDTOPLAY_ELT);
-	if (sound_to_play == NULL) {
-		triggers[trigger_cntr].sound_to_play = NULL;
-	} else {
-		triggers[trigger_cntr].sound_to_play = xmlStrdup(sound_to_play->content);
+/*
+ * atconfig.xml and the files it includes and imports.  What was read from
+ * each file is kept, so a reload only reads the files that have changed,
+ * and then puts the config together from what it has.  A file that was
+ * saved again unchanged isn't read again either, as it is recognized by
+ * its hash.
+ */
+struct config_file {
+	xmlChar *path;
+	struct stat stat;		/* of the file parsed was read from */
+	uint64_t hash;			/* of its contents */
+	struct config *parsed;		/* its sounds and triggers, and atconfig.xml's logfiles */
+	bool in_use;			/* included or imported by the current atconfig.xml */
+	enum import_format import_format;	/* and sound_dir, what it was parsed as */
+	xmlChar *sound_dir;
+	struct timespec seen, settled;	/* for watch_config() */
+	struct config_file *next;
+};
+/* atconfig.xml first, then the trigger packs and imports */
+static struct config_file *config_files;
+
+/* The config_file for path, which is added if it isn't known yet */
+static struct config_file *find_config_file(const xmlChar *path)
+{
+	struct config_file **filep, *file;
+	struct stat stat_buf;
+
+	for (filep = &config_files; (file = *filep) != NULL; filep = &file->next) {
+		if (xmlStrEqual(file->path, path))
+			return file;
 	}
+	file = calloc(1, sizeof(struct config_file));
+	file->path = xmlStrdup(path);
+	if (stat((char *)path, &stat_buf) == 0)
+		file->seen = file->settled = stat_buf.st_mtim;
+	*filep = file;
+	return file;
+}
 
+/* The file being read, in memory, so that its hash is of exactly what gets parsed */
+static char *config_text;
+static size_t config_text_len;
+static struct stat config_text_stat;
+static uint64_t config_text_hash;
 
-	trigger_cntr++;
+static void read_config_text(void)
+{
+	FILE *f;
+
+	f = fopen(reading_file, "rb");
+	if (f == NULL || fstat(fileno(f), &config_text_stat) < 0) {
+		fprintf(stderr, "Error: unable to read file \"%s\": %s\n", reading_file, strerror(errno));
+		if (f != NULL)
+			fclose(f);
+		config_error();
+	}
+	config_text = malloc(config_text_stat.st_size + 1);
+	config_text_len = fread(config_text, 1, config_text_stat.st_size, f);
+	fclose(f);
+	config_text_hash = hash_bytes(FNV_OFFSET_BASIS, config_text, config_text_len);
 }
 
-static void load_triggers_from_config(xmlNodePtr node)
+static xmlTextReaderPtr open_config_xml(void)
 {
-	foreach_sibling(node, TRIGGER_ELT, count_trigger_elements);
-	triggers = malloc(sizeof(struct trigger) * num_triggers);
+	xmlSchemaPtr schema = load_config_schema();
+	xmlTextReaderPtr reader;
 
-	foreach_sibling(node, TRIGGER_ELT, process_trigger_element);
+	reader = xmlReaderForMemory(config_text, config_text_len, reading_file, NULL, XML_PARSE_NONET);
+	if (reader == NULL) {
+		fprintf(stderr, "Error: unable to parse file \"%s\"\n", reading_file);
+		config_error();
+	}
+	config_xml_error_printed = false;
+	xmlTextReaderSetStructuredErrorHandler(reader, (xmlStructuredErrorFunc)print_config_xml_error, NULL);
+	if (xmlTextReaderSetSchema(reader, schema) != 0) {
+		fprintf(stderr, "Error: unable to validate \"%s\"\n", reading_file);
+		xmlFreeTextReader(reader);
+		config_error();
+	}
+	return reader;
 }
 
-static int attach_trigger_cntr;
-static int logfile_cntr;
-
-void count_attach_trigger_elements(xmlNodePtr node)
+/* Also frees the text read by read_config_text(); reader may be NULL */
+static void close_config_xml(xmlTextReaderPtr reader)
 {
-	attach_trigger_cntr++;
+	if (reader != NULL)
+		xmlFreeTextReader(reader);
+	free(config_text);
+	config_text = NULL;
 }
 
-void process_attach_trigger_element(xmlNodePtr node)
+/* Move to the next node, or return false at the end of the file */
+static bool read_config_node(xmlTextReaderPtr reader)
 {
-	xmlChar *name = xmlGetProp(node, LOGFILE_ATTACHTRIGGER_NAME_ATTR);
-	xmlNodePtr children = node->children, stop_search_on_match;
+	int ret = xmlTextReaderRead(reader);
+	xmlErrorPtr error;
 
-	if (name == NULL) {
-		fprintf(stderr, "Unable to find name attribute on attach_trigger element %d\n", logfile_cntr + 1);
-		exit(1);
+	if (ret < 0) {
+		/* with the schema validating, the parser's own errors aren't passed on */
+		error = xmlGetLastError();
+		if (!config_xml_error_printed && error != NULL)
+			print_config_xml_error(NULL, error);
+		fprintf(stderr, "Error: unable to parse file \"%s\"\n", reading_file);
+		config_error();
 	}
-
-	logfiles[logfile_cntr].attached_triggers[attach_trigger_cntr].name = name;
-
-	stop_search_on_match = get_element(children, LOGFILE_ATTACHTRIGGER_STOPSEARCHONMATCH_ELT);
-	if (stop_search_on_match == NULL) {
-		logfiles[logfile_cntr].attached_triggers[attach_trigger_cntr].stop_search_on_match = false;
-		debugmsg("setting stop search on match to false\n");
-	} else {
-		logfiles[logfile_cntr].attached_triggers[attach_trigger_cntr].stop_search_on_match = true;
-		debugmsg("setting stop search on match to true\n");
+	if (xmlTextReaderIsValid(reader) == 0) {
+		fprintf(stderr, "Error: one or more validation errors in the config file \"%s\"\n",
+				reading_file);
+		config_error();
 	}
-	attach_trigger_cntr++;
+	return ret == 1;
 }
 
-void process_logfile_element(xmlNodePtr node)
+/*
+ * Move to the next child element of the element at depth, skipping the
+ * rest of the current child if it wasn't read.  Returns false once the
+ * parent element ends.  An empty parent has no end to stop at, so
+ * foreach_child_element() doesn't call this for one.
+ */
+static bool next_child_element(xmlTextReaderPtr reader, int depth)
 {
-	xmlNodePtr children = node->children, file;
-
-	debugmsg("processing logfile element: %s\n", node->name);
-	file = get_element_text(children, LOGFILE_FILE_ELT);
-	if (file == NULL) {
-		fprintf(stderr, "Unable to find file element in logfile element %d\n", logfile_cntr + 1);
-		exit(1);
+	while (read_config_node(reader)) {
+		if (xmlTextReaderDepth(reader) <= depth)
+			return false;
+		if (xmlTextReaderDepth(reader) == depth + 1 &&
+		    xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT)
+			return true;
 	}
-	logfiles[logfile_cntr].file = xmlStrdup(file->content);
-	debugmsg("logfile found: %s\n", file->content);
+	return false;
+}
+
+/* Iterate over the child elements of the element the reader is on */
+#define foreach_child_element(reader, depth) \
+	for (depth = xmlTextReaderIsEmptyElement(reader) ? -1 : xmlTextReaderDepth(reader); \
+	     depth >= 0 && next_child_element(reader, depth); )
 
-	/* malloc space for the attached trigger pointers */
-	attach_trigger_cntr = 0;
-	foreach_sibling(children, LOGFILE_ATTACHTRIGGER_ELT, count_attach_trigger_elements);
-	logfiles[logfile_cntr].attached_triggers = malloc(sizeof(struct attached_trigger) * attach_trigger_cntr);
-	logfiles[logfile_cntr].num_attached_triggers = attach_trigger_cntr;
+static bool is_element(xmlTextReaderPtr reader, const xmlChar *element)
+{
+	return xmlStrEqual(xmlTextReaderConstName(reader), element);
+}
 
-	attach_trigger_cntr = 0;
-	foreach_sibling(children, LOGFILE_ATTACHTRIGGER_ELT, process_attach_trigger_element);
+/* Get the text within the element the reader is on; free it with xmlFree() */
+static xmlChar *element_text(xmlTextReaderPtr reader)
+{
+	xmlChar *text = xmlTextReaderReadString(reader);
 
-	logfile_cntr++;
+	if (text == NULL)
+		fprintf(stderr, "unable to find text element for %s\n", (char *)xmlTextReaderConstName(reader));
+	return text;
 }
 
-static void load_logfiles_from_config(xmlNodePtr node)
+static void scan_element_text(xmlTextReaderPtr reader, const char *format, void *val)
 {
-	foreach_sibling(node, LOGFILE_ELT, count_logfile_elements);
-	logfiles = malloc(sizeof(struct logfile) * num_logfiles);
+	xmlChar *text = element_text(reader);
 
-	foreach_sibling(node, LOGFILE_ELT, process_logfile_element);
+	if (text != NULL) {
+		sscanf((char *)text, format, val);
+		xmlFree(text);
+	}
 }
 
-static void close_config_xml(xmlDocPtr doc)
+/* Make room for one more in an array that grows by doubling */
+static void *grow_array(void *array, int count, size_t size)
 {
-	xmlFreeDoc(doc);
+	if (count & (count - 1))
+		return array;
+	return realloc(array, (count ? count * 2 : 1) * size);
 }
 
-static void init_xml_lib(void)
+/* Parse a <rate_limit> element of a trigger, attach_trigger or logfile */
+static void process_rate_limit_element(xmlTextReaderPtr reader, struct rate_limit *rl)
 {
-	/* Init libxml */
-	xmlInitParser();
-	LIBXML_TEST_VERSION
+	long burst_val = 1, interval_val = 0;
+	int depth;
+
+	foreach_child_element(reader, depth) {
+		if (is_element(reader, RATE_LIMIT_BURST_ELT))
+			scan_element_text(reader, "%ld", &burst_val);
+		else if (is_element(reader, RATE_LIMIT_INTERVAL_ELT))
+			scan_element_text(reader, "%ld", &interval_val);
+	}
+	init_rate_limit(rl, burst_val, interval_val);
 }
 
-static void init_sound_system(FMOD_SYSTEM **system)
+/* A sound with the default settings, added to the config being loaded */
+static struct sound *add_sound(xmlChar *name)
 {
-	FMOD_RESULT result;
-	unsigned int version;
+	struct sound *sound;
+
+	loading->sounds = grow_array(loading->sounds, loading->num_sounds, sizeof(struct sound));
+	sound = &loading->sounds[loading->num_sounds++];
+
+	sound->name = name;
+	sound->file = NULL;
+	sound->vol = USE_DEFAULT;
+	sound->pan = USE_DEFAULT;
+	sound->prio = USE_DEFAULT_PRIO;
+	sound->max_age = 0;
+	sound->max_polyphony = 0;
+	sound->storage = STORAGE_AUTO;
+	sound->preload = false;
+	init_rate_limit(&sound->min_interval, 1, 0);
+	return sound;
+}
 
-	result = FMOD_System_Create(system);
-	ERRCHECK(result);
+static void process_sound_element(xmlTextReaderPtr reader)
+{
+	struct sound *sound;
+	long min_interval_val = 0;
+	xmlChar *storage;
+	int depth;
+
+	sound = add_sound(xmlTextReaderGetAttribute(reader, SOUND_NAME_ATTR));
+	if (sound->name == NULL) {
+		fprintf(stderr, "Unable to find name attribute on sound element %d\n", loading->num_sounds);
+		config_error();
+	}
 
-	result = FMOD_System_GetVersion(*system, &version);
-	ERRCHECK(result);
+	foreach_child_element(reader, depth) {
+		if (is_element(reader, SOUND_FILE_ELT)) {
+			sound->file = element_text(reader);
+		} else if (is_element(reader, SOUND_VOL_ELT)) {
+			scan_element_text(reader, "%f", &sound->vol);
+			debugmsg("vol : %f\n", sound->vol);
+		} else if (is_element(reader, SOUND_PAN_ELT)) {
+			scan_element_text(reader, "%f", &sound->pan);
+		} else if (is_element(reader, SOUND_PRIO_ELT)) {
+			scan_element_text(reader, "%d", &sound->prio);
+		} else if (is_element(reader, SOUND_MIN_INTERVAL_ELT)) {
+			scan_element_text(reader, "%ld", &min_interval_val);
+		} else if (is_element(reader, SOUND_MAX_AGE_ELT)) {
+			scan_element_text(reader, "%ld", &sound->max_age);
+		} else if (is_element(reader, SOUND_MAX_POLYPHONY_ELT)) {
+			scan_element_text(reader, "%d", &sound->max_polyphony);
+		} else if (is_element(reader, SOUND_STORAGE_ELT)) {
+			storage = element_text(reader);
+			if (xmlStrEqual(storage, (xmlChar *)"pcm")) {
+				sound->storage = STORAGE_PCM;
+			} else if (xmlStrEqual(storage, (xmlChar *)"compressed")) {
+				sound->storage = STORAGE_COMPRESSED;
+			} else if (xmlStrEqual(storage, (xmlChar *)"stream")) {
+				sound->storage = STORAGE_STREAM;
+			}
+			xmlFree(storage);
+		} else if (is_element(reader, SOUND_PRELOAD_ELT)) {
+			sound->preload = true;
+		}
+	}
 
-	if (version < FMOD_VERSION) {
-		printf("Error!  You are using an old version of FMOD %08x.  This program requires %08x\n",
-			version, FMOD_VERSION);
-		exit(1);
+	if (sound->file == NULL) {
+		fprintf(stderr, "Unable to find file element in sound element %d\n", loading->num_sounds);
+		config_error();
 	}
+	init_rate_limit(&sound->min_interval, 1, min_interval_val);
+}
 
-	result = FMOD_System_Init(*system, 32, FMOD_INIT_NORMAL, NULL);
-	ERRCHECK(result);
+/* A trigger with the default settings, added to the config being loaded */
+static struct trigger *add_trigger(xmlChar *name)
+{
+	struct trigger *trigger;
+
+	loading->triggers = grow_array(loading->triggers, loading->num_triggers, sizeof(struct trigger));
+	trigger = &loading->triggers[loading->num_triggers++];
+
+	trigger->name = name;
+	trigger->pattern = NULL;
+	trigger->sound_to_play = NULL;
+	trigger->group = NULL;
+	trigger->enable_groups = NULL;
+	trigger->disable_groups = NULL;
+	init_rate_limit(&trigger->rate_limit, 1, 0);
+	trigger->dedup_window_ns = (int64_t)runtime.dedup_window * NS_IN_MS;
+	return trigger;
 }
 
-static void open_all_sounds(FMOD_SYSTEM *system, FMOD_SOUND **fmod_sounds) {
-	FMOD_RESULT result;
-	int i;
+static void process_trigger_element(xmlTextReaderPtr reader)
+{
+	struct trigger *trigger;
+	long dedup_window_val = runtime.dedup_window;
+	int depth;
 
-	for (i = 0; i < num_sounds; i++) {
-		float freq, vol, pan;
-		int prio;
+	debugmsg("processing trigger element: %s\n", xmlTextReaderConstName(reader));
 
-		debugmsg("opening sound file %s\n", sounds[i].file);
-		result = FMOD_System_CreateSound(system, (char *)sounds[i].file,
-				FMOD_SOFTWARE, 0, &fmod_sounds[i]);
-		if (result != FMOD_OK) {
-			fprintf(stderr, "Unable to open sound file \"%s\"\n", sounds[i].file);
-			exit(1);
-		}
-		result = FMOD_Sound_SetMode(fmod_sounds[i], FMOD_LOOP_OFF);
-		ERRCHECK(result);
+	/* Note that there is a comment element too, but it is ignored by this code */
 
-		result = FMOD_Sound_GetDefaults(fmod_sounds[i], &freq, &vol,
-				&pan, &prio);
-		ERRCHECK(result);
+	trigger = add_trigger(xmlTextReaderGetAttribute(reader, TRIGGER_NAME_ATTR));
+	if (trigger->name == NULL) {
+		fprintf(stderr, "Unable to find name attribute on trigger element %d\n", loading->num_triggers);
+		config_error();
+	}
 
-		/* override defaults (except freq) as requested */
-		if (sounds[i].vol != USE_DEFAULT) {
-			debugmsg("setting vol value on %s to %f\n", sounds[i].file, sounds[i].vol);
-			vol = sounds[i].vol;
-		}
-		if (sounds[i].pan != USE_DEFAULT) {
-			debugmsg("setting pan value on %s to %f\n", sounds[i].file, sounds[i].pan);
-			pan = sounds[i].pan;
-		}
-		if (sounds[i].prio != USE_DEFAULT_PRIO) {
-			debugmsg("setting prio value on %s to %d\n", sounds[i].file, sounds[i].prio);
-			prio = sounds[i].prio;
+	foreach_child_element(reader, depth) {
+		if (is_element(reader, TRIGGER_PATTERN_ELT)) {
+			trigger->pattern = element_text(reader);
+		} else if (is_element(reader, TRIGGER_SOUNDTOPLAY_ELT)) {
+			trigger->sound_to_play = element_text(reader);
+		} else if (is_element(reader, RATE_LIMIT_ELT)) {
+			process_rate_limit_element(reader, &trigger->rate_limit);
+		} else if (is_element(reader, TRIGGER_DEDUPWINDOW_ELT)) {
+			scan_element_text(reader, "%ld", &dedup_window_val);
+		} else if (is_element(reader, TRIGGER_GROUP_ELT)) {
+			trigger->group = element_text(reader);
+		} else if (is_element(reader, TRIGGER_ENABLEGROUPS_ELT)) {
+			trigger->enable_groups = element_text(reader);
+		} else if (is_element(reader, TRIGGER_DISABLEGROUPS_ELT)) {
+			trigger->disable_groups = element_text(reader);
 		}
+	}
 
-		result = FMOD_Sound_SetDefaults(fmod_sounds[i], freq, vol, pan,
-						prio);
-		ERRCHECK(result);
+	if (trigger->pattern == NULL) {
+		fprintf(stderr, "Unable to find pattern element in trigger element %d\n", loading->num_triggers);
+		config_error();
 	}
+	trigger->dedup_window_ns = (int64_t)dedup_window_val * NS_IN_MS;
 }
 
-static void open_all_logfiles(void)
+static void process_attach_trigger_element(xmlTextReaderPtr reader, struct logfile *logfile)
 {
-	int i, ret;
+	struct attached_trigger *at;
+	int depth;
 
-	for (i = 0; i < num_logfiles; i++) {
-		lfi[i].file = fopen((char *)logfiles[i].file, "r");
-		if (lfi[i].file == NULL) {
-			fprintf(stderr, "Unable to open logfile \"%s\": %s\n", logfiles[i].file, strerror(errno));
-			exit(1);
-		}
-		ret = pthread_create(&lfi[i].thread, NULL, logwatcher, (void *)(intptr_t)i);
-		if (ret < 0) {
-			fprintf(stderr, "Unable to create logwatcher pthread for log file %d\n", i);
-			exit(1);
+	logfile->attached_triggers = grow_array(logfile->attached_triggers,
+			logfile->num_attached_triggers, sizeof(struct attached_trigger));
+	at = &logfile->attached_triggers[logfile->num_attached_triggers++];
+
+	at->name = xmlTextReaderGetAttribute(reader, LOGFILE_ATTACHTRIGGER_NAME_ATTR);
+	if (at->name == NULL) {
+		fprintf(stderr, "Unable to find name attribute on attach_trigger element %d\n", loading->num_logfiles);
+		config_error();
+	}
+	at->stop_search_on_match = false;
+	init_rate_limit(&at->rate_limit, 1, 0);
+
+	foreach_child_element(reader, depth) {
+		if (is_element(reader, LOGFILE_ATTACHTRIGGER_STOPSEARCHONMATCH_ELT))
+			at->stop_search_on_match = true;
+		else if (is_element(reader, RATE_LIMIT_ELT))
+			process_rate_limit_element(reader, &at->rate_limit);
+	}
+	debugmsg("setting stop search on match to %s\n", at->stop_search_on_match ? "true" : "false");
+}
+
+/* A trigger file to import once atconfig.xml has been read, for the logfile being read */
+static void process_import_element(xmlTextReaderPtr reader)
+{
+	struct import *import;
+	xmlChar *format;
+
+	loading->imports = grow_array(loading->imports, loading->num_imports, sizeof(struct import));
+	import = &loading->imports[loading->num_imports++];
+	format = xmlTextReaderGetAttribute(reader, IMPORT_FORMAT_ATTR);
+	import->format = xmlStrEqual(format, (xmlChar *)"eq") ? IMPORT_EQ : IMPORT_GTT;
+	xmlFree(format);
+	import->sound_dir = xmlTextReaderGetAttribute(reader, IMPORT_SOUNDDIR_ATTR);
+	import->logfile = loading->num_logfiles - 1;
+	import->path = element_text(reader);
+	if (import->path == NULL)
+		config_error();
+}
+
+static void process_logfile_element(xmlTextReaderPtr reader)
+{
+	struct logfile *logfile;
+	int depth;
+
+	debugmsg("processing logfile element: %s\n", xmlTextReaderConstName(reader));
+
+	loading->logfiles = grow_array(loading->logfiles, loading->num_logfiles, sizeof(struct logfile));
+	logfile = &loading->logfiles[loading->num_logfiles++];
+	logfile->file = NULL;
+	logfile->attached_triggers = NULL;
+	logfile->num_attached_triggers = 0;
+	init_rate_limit(&logfile->rate_limit, 1, 0);
+
+	foreach_child_element(reader, depth) {
+		if (is_element(reader, LOGFILE_FILE_ELT)) {
+			logfile->file = element_text(reader);
+			debugmsg("logfile found: %s\n", logfile->file);
+		} else if (is_element(reader, RATE_LIMIT_ELT)) {
+			process_rate_limit_element(reader, &logfile->rate_limit);
+		} else if (is_element(reader, LOGFILE_ATTACHTRIGGER_ELT)) {
+			process_attach_trigger_element(reader, logfile);
+		} else if (is_element(reader, LOGFILE_IMPORT_ELT)) {
+			process_import_element(reader);
 		}
 	}
+
+	if (logfile->file == NULL) {
+		fprintf(stderr, "Unable to find file element in logfile element %d\n", loading->num_logfiles);
+		config_error();
+	}
 }
 
-static void match_triggers_with_sounds(void)
+/* A trigger pack to read once atconfig.xml has been */
+static void process_include_element(xmlTextReaderPtr reader)
 {
-	int i, j;
+	xmlChar *path = element_text(reader);
+
+	if (path == NULL)
+		config_error();
+	loading->includes = grow_array(loading->includes, loading->num_includes, sizeof(xmlChar *));
+	loading->includes[loading->num_includes++] = path;
+}
 
-	for (i = 0; i < num_triggers; i++) {
-		bool found = false;
-		if (triggers[i].sound_to_play == NULL) {
-			triggers[i].sound_to_play_id = NO_SOUND;
+/* Parse a CPU list such as "0,2-3" */
+static void parse_cpu_list(const char *list, struct thread_settings *ts)
+{
+#ifdef CPU_SETSIZE
+	const char *p = list;
+	char *end;
+	long first, last;
+
+	CPU_ZERO(&ts->cpus);
+	while (*p) {
+		if (*p == ',' || isspace((int)*p)) {
+			p++;
 			continue;
 		}
-		for (j = 0; j < num_sounds; j++) {
-			if (xmlStrEqual(triggers[i].sound_to_play, sounds[j].name)) {
-				found = true;
-				triggers[i].sound_to_play_id = j;
-			}
+		first = last = strtol(p, &end, 10);
+		if (end == p)
+			goto bad_list;
+		p = end;
+		if (*p == '-') {
+			p++;
+			last = strtol(p, &end, 10);
+			if (end == p)
+				goto bad_list;
+			p = end;
 		}
-		if (!found) {
-			fprintf(stderr, "Unable to find sound: %s for trigger: %s\n", triggers[i].sound_to_play, triggers[i].name);
-			exit(1);
+		if (first < 0 || last < first || last >= CPU_SETSIZE)
+			goto bad_list;
+		for (; first <= last; first++)
+			CPU_SET(first, &ts->cpus);
+	}
+	ts->set_cpus = true;
+	return;
+
+bad_list:
+	fprintf(stderr, "Invalid CPU list \"%s\" in <runtime>\n", list);
+	exit(1);
+#else
+	fprintf(stderr, "WARNING: CPU affinity is not supported on this platform, ignoring <cpus>\n");
+#endif
+}
+
+static void process_thread_settings_element(xmlTextReaderPtr reader, struct thread_settings *ts)
+{
+	xmlChar *text;
+	bool set_priority = false;
+	int depth;
+
+	foreach_child_element(reader, depth) {
+		if (is_element(reader, THREAD_SCHEDULING_ELT)) {
+			text = element_text(reader);
+			if (xmlStrEqual(text, (xmlChar *)"fifo")) {
+				ts->policy = SCHED_FIFO;
+			} else if (xmlStrEqual(text, (xmlChar *)"rr")) {
+				ts->policy = SCHED_RR;
+			}
+			xmlFree(text);
+		} else if (is_element(reader, THREAD_PRIORITY_ELT)) {
+			scan_element_text(reader, "%d", &ts->priority);
+			set_priority = true;
+		} else if (is_element(reader, THREAD_NICE_ELT)) {
+			scan_element_text(reader, "%d", &ts->nice);
+			ts->set_nice = true;
+		} else if (is_element(reader, THREAD_CPUS_ELT)) {
+			text = element_text(reader);
+			if (text != NULL)
+				parse_cpu_list((char *)text, ts);
+			xmlFree(text);
 		}
 	}
+	if (!set_priority)
+		ts->priority = sched_get_priority_min(ts->policy);
 }
 
-static void match_logfiles_with_triggers(void)
+static void init_thread_settings(struct thread_settings *ts)
 {
-	int i, j, k;
+	ts->policy = SCHED_OTHER;
+	ts->priority = sched_get_priority_min(ts->policy);
+	ts->set_nice = false;
+	ts->set_cpus = false;
+}
 
-	for (i = 0; i < num_logfiles; i++) {
-		for (j = 0; j < logfiles[i].num_attached_triggers; j++) {
-			bool found = false;
-			for (k = 0; k < num_triggers; k++) {
-				if (xmlStrEqual(logfiles[i].attached_triggers[j].name, triggers[k].name)) {
-					found = true;
-					logfiles[i].attached_triggers[j].trigger_id = k;
-				}
+static void init_runtime(void)
+{
+	init_thread_settings(&runtime.dispatcher);
+	init_thread_settings(&runtime.logwatcher);
+	runtime.dedup_window = 0;
+}
+
+static void process_runtime_element(xmlTextReaderPtr reader)
+{
+	int depth;
+
+	foreach_child_element(reader, depth) {
+		if (is_element(reader, RUNTIME_DISPATCHER_ELT))
+			process_thread_settings_element(reader, &runtime.dispatcher);
+		else if (is_element(reader, RUNTIME_LOGWATCHER_ELT))
+			process_thread_settings_element(reader, &runtime.logwatcher);
+		else if (is_element(reader, RUNTIME_DEDUPWINDOW_ELT))
+			scan_element_text(reader, "%ld", &runtime.dedup_window);
+	}
+}
+
+static void init_audio(void)
+{
+	audio.update_interval = 20;
+	audio.voice_stealing = STEAL_PRIORITY;
+	audio.channels = 32;
+	audio.virtual_voices = 256;
+	audio.output = FMOD_OUTPUTTYPE_AUTODETECT;
+	audio.driver_arguments = NULL;
+	audio.sample_rate = 0;
+	audio.dsp_buffer_length = 0;
+	audio.dsp_num_buffers = 0;
+	audio.sound_memory_budget = 0;
+	audio.stream_threshold = 1024;
+	audio.sound_cache_size = 0;
+	audio.sound_bank = NULL;
+}
+
+static void process_audio_element(xmlTextReaderPtr reader)
+{
+	xmlChar *text;
+	int depth, i;
+
+	foreach_child_element(reader, depth) {
+		if (is_element(reader, AUDIO_UPDATEINTERVAL_ELT)) {
+			scan_element_text(reader, "%ld", &audio.update_interval);
+		} else if (is_element(reader, AUDIO_VOICESTEALING_ELT)) {
+			text = element_text(reader);
+			if (xmlStrEqual(text, (xmlChar *)"none")) {
+				audio.voice_stealing = STEAL_NONE;
+			} else if (xmlStrEqual(text, (xmlChar *)"oldest")) {
+				audio.voice_stealing = STEAL_OLDEST;
+			} else if (xmlStrEqual(text, (xmlChar *)"quietest")) {
+				audio.voice_stealing = STEAL_QUIETEST;
 			}
-			if (!found) {
-				fprintf(stderr, "Unable to find trigger: %s for logfile: %s\n", logfiles[i].attached_triggers[j].name, logfiles[i].file);
-				exit(1);
+			xmlFree(text);
+		} else if (is_element(reader, AUDIO_CHANNELS_ELT)) {
+			scan_element_text(reader, "%d", &audio.channels);
+		} else if (is_element(reader, AUDIO_VIRTUALVOICES_ELT)) {
+			scan_element_text(reader, "%d", &audio.virtual_voices);
+		} else if (is_element(reader, AUDIO_OUTPUT_ELT)) {
+			text = element_text(reader);
+			for (i = 0; i < NUM_OUTPUT_TYPES; i++) {
+				if (xmlStrEqual(text, (xmlChar *)output_types[i].name))
+					audio.output = output_types[i].type;
 			}
+			xmlFree(text);
+		} else if (is_element(reader, AUDIO_DRIVERARGUMENTS_ELT)) {
+			audio.driver_arguments = element_text(reader);
+		} else if (is_element(reader, AUDIO_SAMPLERATE_ELT)) {
+			scan_element_text(reader, "%d", &audio.sample_rate);
+		} else if (is_element(reader, AUDIO_DSPBUFFERLENGTH_ELT)) {
+			scan_element_text(reader, "%u", &audio.dsp_buffer_length);
+		} else if (is_element(reader, AUDIO_DSPNUMBUFFERS_ELT)) {
+			scan_element_text(reader, "%d", &audio.dsp_num_buffers);
+		} else if (is_element(reader, AUDIO_SOUNDMEMORYBUDGET_ELT)) {
+			scan_element_text(reader, "%ld", &audio.sound_memory_budget);
+		} else if (is_element(reader, AUDIO_STREAMTHRESHOLD_ELT)) {
+			scan_element_text(reader, "%ld", &audio.stream_threshold);
+		} else if (is_element(reader, AUDIO_SOUNDCACHESIZE_ELT)) {
+			scan_element_text(reader, "%ld", &audio.sound_cache_size);
+		} else if (is_element(reader, AUDIO_SOUNDBANK_ELT)) {
+			audio.sound_bank = element_text(reader);
 		}
 	}
+	/* a zero interval would have the dispatcher spin */
+	if (audio.update_interval < 1)
+		audio.update_interval = 1;
+	if (audio.virtual_voices < audio.channels)
+		audio.virtual_voices = audio.channels;
 }
 
+static void init_xml_lib(void)
+{
+	/* Init libxml */
+	xmlInitParser();
+	LIBXML_TEST_VERSION
+}
 
-static void release_all_sounds(FMOD_SOUND **fmod_sounds)
+static const char *output_type_name(FMOD_OUTPUTTYPE type)
 {
 	int i;
-	FMOD_RESULT result;
 
-	for (i = 0; i < num_sounds; i++) {
-		result = FMOD_Sound_Release(fmod_sounds[i]);
-		ERRCHECK(result);
+	for (i = 0; i < NUM_OUTPUT_TYPES; i++) {
+		if (output_types[i].type == type)
+			return output_types[i].name;
 	}
+	return "unknown";
 }
 
-static void close_sound_system(FMOD_SYSTEM *system)
+/*
+ * Time from FMOD_System_PlaySound() until the mixer has started consuming a
+ * (silent) sound.  This is the latency FMOD's own buffering adds between a
+ * log line and the speakers; the sound card and driver add theirs on top.
+ * Returns -1 if it couldn't be measured.
+ */
+static double measure_mixer_latency(FMOD_SYSTEM *system, int sample_rate)
 {
-	FMOD_RESULT result;
+	FMOD_CREATESOUNDEXINFO exinfo;
+	FMOD_SOUND *silence;
+	FMOD_CHANNEL *chan;
+	unsigned int position = 0;
+	int64_t start, end;
+
+	memset(&exinfo, 0, sizeof(exinfo));
+	exinfo.cbsize = sizeof(exinfo);
+	exinfo.length = sample_rate * 2;	/* one second of mono PCM16 */
+	exinfo.numchannels = 1;
+	exinfo.defaultfrequency = sample_rate;
+	exinfo.format = FMOD_SOUND_FORMAT_PCM16;
+	if (FMOD_System_CreateSound(system, NULL, FMOD_SOFTWARE | FMOD_OPENUSER | FMOD_LOOP_OFF,
+			&exinfo, &silence) != FMOD_OK)
+		return -1;
+
+	start = end = now_ns();
+	if (FMOD_System_PlaySound(system, FMOD_CHANNEL_FREE, silence, 0, &chan) == FMOD_OK) {
+		while (end - start < NS_IN_SEC) {
+			FMOD_System_Update(system);
+			if (FMOD_Channel_GetPosition(chan, &position, FMOD_TIMEUNIT_PCM) != FMOD_OK ||
+			    position > 0)
+				break;
+			usleep(500);
+			end = now_ns();
+		}
+		end = now_ns();
+		FMOD_Channel_Stop(chan);
+	}
+	FMOD_Sound_Release(silence);
 
-	result = FMOD_System_Close(system);
-	ERRCHECK(result);
-	result = FMOD_System_Release(system);
-	ERRCHECK(result);
+	return position > 0 ? (double)(end - start) / NS_IN_MS : -1;
 }
 
-static void print_thankyou(void) {
-	printf("---------------------------------------------------\n");
-	printf("--              AudioTriggers+ 1.0               --\n");
-	printf("--                                               --\n");
-	printf("--  Implementation uses the FMODex Sound System  --\n");
-	printf("--    from Firelight Technologies @ FMOD.org     --\n");
-	printf("---------------------------------------------------\n");
+static void report_latency(FMOD_SYSTEM *system)
+{
+	FMOD_OUTPUTTYPE output;
+	unsigned int buffer_length;
+	int num_buffers, sample_rate;
+	double latency;
+
+	FMOD_System_GetOutput(system, &output);
+	FMOD_System_GetDSPBufferSize(system, &buffer_length, &num_buffers);
+	FMOD_System_GetSoftwareFormat(system, &sample_rate, NULL, NULL, NULL, NULL, NULL);
+
+	printf("Audio output: %s, %d Hz, DSP buffer %u samples x %d (%.1f ms)\n",
+			output_type_name(output), sample_rate, buffer_length, num_buffers,
+			1000.0 * buffer_length * num_buffers / sample_rate);
+	latency = measure_mixer_latency(system, sample_rate);
+	if (latency < 0) {
+		printf("Audio output: unable to measure the mixer latency\n");
+	} else {
+		printf("Audio output: measured %.1f ms from play request to mixing\n", latency);
+	}
 }
 
-int main(int argc, char *argv[]) {
-	FMOD_SYSTEM *system;
-	FMOD_SOUND **fmod_sounds;
+static void init_sound_system(FMOD_SYSTEM **system)
+{
 	FMOD_RESULT result;
-	xmlDocPtr doc;
-	xmlNodePtr node;
-	int ret;
-
-	ret = pthread_cond_init(&events.events_available, NULL);
-	if (ret < 0) {
-		fprintf(stderr, "Unable to initialize the events cond object\n");
-	}
-	ret = pthread_mutex_init(&events.lock, NULL);
-	if (ret < 0) {
-		fprintf(stderr, "Unable to initialize the events lock object\n");
-	}
+	unsigned int version;
+	FMOD_LINUX_EXTRADRIVERDATA linux_driver_data;
+	void *extradriverdata = NULL;
+	int sample_rate, num_output_channels, max_input_channels;
+	FMOD_SOUND_FORMAT format;
+	FMOD_DSP_RESAMPLER resampler;
 
-	init_sound_system(&system);
-	init_xml_lib();
+	result = FMOD_System_Create(system);
+	ERRCHECK(result);
 
-	open_config_xml(&doc);
-	node = doc->children;
+	result = FMOD_System_GetVersion(*system, &version);
+	ERRCHECK(result);
 
-	while (node) {
-		if (xmlStrEqual(node->name, AUDIOTRIGGERS_ELT)) {
-			break;
-		}
-		node = node->next;
-	}
-	if (!node) {
-		fprintf(stderr, "Unable to find <audiotriggers> element at root of %s\n", CONFIG_XML);
+	if (version < FMOD_VERSION) {
+		printf("Error!  You are using an old version of FMOD %08x.  This program requires %08x\n",
+			version, FMOD_VERSION);
 		exit(1);
 	}
-	
-	node = node->children;
-	load_sounds_from_config(node);
-	load_triggers_from_config(node);
-	load_logfiles_from_config(node);
-	close_config_xml(doc);
-
-	fmod_sounds = malloc(sizeof(FMOD_SOUND *) * num_sounds);
-	open_all_sounds(system, fmod_sounds);
-
-	lfi = malloc(sizeof(struct log_file_info) * num_logfiles);
-	open_all_logfiles();
 
-	match_triggers_with_sounds();
+	/*
+	 * Only audio.channels voices are mixed; FMOD tracks the rest as virtual
+	 * voices and swaps them in and out by priority and volume.
+	 */
+	result = FMOD_System_SetSoftwareChannels(*system, audio.channels);
+	ERRCHECK(result);
+
+	if (audio.output != FMOD_OUTPUTTYPE_AUTODETECT) {
+		result = FMOD_System_SetOutput(*system, audio.output);
+		if (result != FMOD_OK) {
+			fprintf(stderr, "Error: unable to use the %s audio output: %s\n",
+					output_type_name(audio.output), FMOD_ErrorString(result));
+			exit(1);
+		}
+	}
+	if (audio.driver_arguments != NULL) {
+		if (audio.output == FMOD_OUTPUTTYPE_ALSA) {
+			memset(&linux_driver_data, 0, sizeof(linux_driver_data));
+			linux_driver_data.output_driver_arguments = (char *)audio.driver_arguments;
+			extradriverdata = &linux_driver_data;
+		} else if (audio.output == FMOD_OUTPUTTYPE_WAVWRITER) {
+			extradriverdata = audio.driver_arguments;
+		}
+	}
+
+	/* smaller and fewer buffers mean less latency, at the risk of dropouts */
+	if (audio.dsp_buffer_length || audio.dsp_num_buffers) {
+		unsigned int buffer_length;
+		int num_buffers;
+
+		result = FMOD_System_GetDSPBufferSize(*system, &buffer_length, &num_buffers);
+		ERRCHECK(result);
+		if (audio.dsp_buffer_length)
+			buffer_length = audio.dsp_buffer_length;
+		if (audio.dsp_num_buffers)
+			num_buffers = audio.dsp_num_buffers;
+		result = FMOD_System_SetDSPBufferSize(*system, buffer_length, num_buffers);
+		ERRCHECK(result);
+	}
+	if (audio.sample_rate) {
+		result = FMOD_System_GetSoftwareFormat(*system, &sample_rate, &format,
+				&num_output_channels, &max_input_channels, &resampler, NULL);
+		ERRCHECK(result);
+		result = FMOD_System_SetSoftwareFormat(*system, audio.sample_rate, format,
+				num_output_channels, max_input_channels, resampler);
+		ERRCHECK(result);
+	}
+
+	result = FMOD_System_Init(*system, audio.virtual_voices,
+			FMOD_INIT_NORMAL | FMOD_INIT_VOL0_BECOMES_VIRTUAL, extradriverdata);
+	if (result != FMOD_OK) {
+		fprintf(stderr, "Error: unable to initialize the %s audio output: %s\n",
+				output_type_name(audio.output), FMOD_ErrorString(result));
+		exit(1);
+	}
+
+	report_latency(*system);
+}
+
+/* True for the formats FMOD_CREATECOMPRESSEDSAMPLE can keep compressed: MPEG and IMA ADPCM */
+static bool is_compressible(const char *file)
+{
+	const char *ext = strrchr(file, '.');
+	unsigned char header[64];
+	size_t len, i;
+	FILE *f;
+
+	if (ext == NULL)
+		return false;
+	if (strcasecmp(ext, ".mp3") == 0 || strcasecmp(ext, ".mp2") == 0)
+		return true;
+	if (strcasecmp(ext, ".wav") != 0)
+		return false;
+
+	/* look for an IMA ADPCM format tag in the "fmt " chunk */
+	f = fopen(file, "rb");
+	if (f == NULL)
+		return false;
+	len = fread(header, 1, sizeof(header), f);
+	fclose(f);
+	for (i = 12; i + 10 <= len; i++) {
+		if (memcmp(&header[i], "fmt ", 4) == 0)
+			return header[i + 8] == 0x11 && header[i + 9] == 0x00;
+	}
+	return false;
+}
+
+/*
+ * Pick the storage for a <storage>auto</storage> sound: big files are
+ * streamed, MP3 and ADPCM files are kept compressed, and everything else
+ * is decoded to PCM.  Once the sounds loaded so far have used up the
+ * memory budget, the rest are streamed.
+ */
+static enum sound_storage choose_storage(const struct sound *sound, off_t file_size,
+		unsigned long memory_used)
+{
+	if (sound->storage != STORAGE_AUTO)
+		return sound->storage;
+	if (audio.sound_memory_budget > 0 && memory_used >= audio.sound_memory_budget * 1024 * 1024)
+		return STORAGE_STREAM;
+	if (file_size > audio.stream_threshold * 1024)
+		return STORAGE_STREAM;
+	if (is_compressible((char *)sound->file))
+		return STORAGE_COMPRESSED;
+	return STORAGE_PCM;
+}
+
+static int num_sounds_loading;
+static bool sounds_reported;
+/* bytes used by the loaded on demand sounds */
+static unsigned long sound_cache_used;
+
+/* With a sound cache, sounds not marked <preload/> are loaded when first played */
+static bool on_demand(const struct sound_data *data)
+{
+	return audio.sound_cache_size > 0 && !data->preload;
+}
+
+/* FNV-1a hash of a file's contents */
+static uint64_t hash_file(const char *path)
+{
+	uint64_t hash = FNV_OFFSET_BASIS;
+	unsigned char buf[65536];
+	size_t len;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return 0;
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+		hash = hash_bytes(hash, buf, len);
+	fclose(f);
+	return hash;
+}
+
+static bool same_file_version(const struct sound_data *data, const struct stat *stat_buf)
+{
+	return data->size == stat_buf->st_size && data->mtime == stat_buf->st_mtim.tv_sec &&
+	       data->mtime_nsec == stat_buf->st_mtim.tv_nsec &&
+	       data->dev == stat_buf->st_dev && data->ino == stat_buf->st_ino;
+}
+
+/*
+ * The hash of the contents a sound_data was made for, or false if they
+ * can't be read any more because its file has been changed since, or the
+ * dispatcher released the entry meanwhile.  Called with sound_data_lock
+ * held, which is dropped while the file is read.
+ */
+static bool sound_data_hash(int id, uint64_t *hash)
+{
+	struct sound_data version = sound_data[id];
+	struct stat stat_buf;
+	uint64_t file_hash = 0;
+	char *path;
+	bool found;
+
+	if (!sound_data[id].hashed) {
+		path = strdup(sound_data[id].path);
+		pthread_mutex_unlock(&sound_data_lock);
+		found = stat(path, &stat_buf) == 0 && same_file_version(&version, &stat_buf);
+		if (found)
+			file_hash = hash_file(path);
+		pthread_mutex_lock(&sound_data_lock);
+		found = found && sound_data[id].path != NULL && strcmp(sound_data[id].path, path) == 0 &&
+		        same_file_version(&sound_data[id], &stat_buf);
+		free(path);
+		if (!found)
+			return false;
+		sound_data[id].hash = file_hash;
+		sound_data[id].hashed = true;
+	}
+	*hash = sound_data[id].hash;
+	return true;
+}
+
+/*
+ * Sets a sound's sound data to that of its file, adding it if no other
+ * <sound> uses the same file or an identical copy of it with the same
+ * storage.  Files are only hashed when there is another one of the same
+ * size to compare with.  Streams are never shared, as a stream can only
+ * play once at a time.  Called with sound_data_lock held; the sound's
+ * data_id keeps the entry from being released while it is dropped.
+ */
+static int find_sound_data(struct sound *sound, const char *path, const struct stat *stat_buf,
+		enum sound_storage storage)
+{
+	struct sound_data *data;
+	uint64_t hash, other_hash;
+	int i, id = -1;
+
+	for (i = 0; i < num_sound_data; i++) {
+		if (sound_data[i].path == NULL) {
+			if (id < 0)
+				id = i;
+		} else if (storage != STORAGE_STREAM && sound_data[i].storage == storage &&
+		    same_file_version(&sound_data[i], stat_buf) && strcmp(sound_data[i].path, path) == 0) {
+			sound->data_id = i;
+			return i;
+		}
+	}
+
+	/* reuse an entry release_unused_sound_data() freed */
+	if (id < 0) {
+		if (num_sound_data == sound_data_size) {
+			sound_data_size = sound_data_size ? sound_data_size * 2 : 64;
+			sound_data = realloc(sound_data, sizeof(struct sound_data) * sound_data_size);
+		}
+		id = num_sound_data++;
+	}
+	data = &sound_data[id];
+	data->fmod_sound = NULL;
+	data->path = strdup(path);
+	data->size = stat_buf->st_size;
+	data->mtime = stat_buf->st_mtim.tv_sec;
+	data->mtime_nsec = stat_buf->st_mtim.tv_nsec;
+	data->dev = stat_buf->st_dev;
+	data->ino = stat_buf->st_ino;
+	data->hashed = false;
+	data->storage = storage;
+	data->state = SOUND_UNLOADED;
+	data->preload = false;
+	/* FMOD's defaults, until the file's own are known */
+	data->vol = 1.0;
+	data->pan = 0.0;
+	data->prio = DEFAULT_PRIO;
+	data->num_playing = 0;
+	data->memory = 0;
+	data->last_used = 0;
+	data->loads = data->evictions = 0;
+	data->in_cache = false;
+	data->pending = NULL;
+	data->num_pending = 0;
+	sound->data_id = id;
+
+	if (storage == STORAGE_STREAM)
+		return id;
+	for (i = 0; i < num_sound_data; i++) {
+		/* entries released while the lock was dropped have no path */
+		if (i == id || sound_data[i].path == NULL || sound_data[i].storage != storage ||
+		    sound_data[i].size != sound_data[id].size)
+			continue;
+		/* both hashes are kept, so each file is read at most once */
+		if (!sound_data_hash(id, &hash))
+			break;
+		if (sound_data_hash(i, &other_hash) && other_hash == hash) {
+			free(sound_data[id].path);
+			sound_data[id].path = NULL;
+			sound->data_id = i;
+			return i;
+		}
+	}
+	return id;
+}
+
+/*
+ * A sound bank holds sound files already decoded to 16 bit PCM at the
+ * mixer's sample rate, so they can be handed to FMOD straight from the
+ * mmap()ed file, and the page cache shares them between instances.  It is
+ * laid out, in native byte order, as a bank_header, num_entries
+ * bank_entrys, the NUL terminated canonical file names they were made
+ * from, and the PCM data.  Each sound starts on a BANK_ALIGN boundary and
+ * has BANK_PAD bytes of silence on either side, which FMOD wants for
+ * FMOD_OPENMEMORY_POINT.
+ */
+#define BANK_MAGIC "ATBANK"
+#define BANK_VERSION 2
+#define BANK_ALIGN 16
+#define BANK_PAD 16
+#define BANK_MAX_CHANNELS 8
+#define BANK_MIN_RATE 8000
+#define BANK_MAX_RATE 192000
+struct bank_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t sample_rate;
+	uint32_t num_entries;
+	uint32_t reserved;
+};
+struct bank_entry {
+	uint64_t name_offset;
+	uint64_t data_offset;
+	uint64_t data_length;	/* bytes */
+	uint64_t file_size;	/* of the file it was made from, to spot changes */
+	int64_t file_mtime;
+	uint32_t channels;
+	uint32_t file_mtime_nsec;	/* a file rewritten within the same second is still a change */
+};
+
+static struct {
+	char *base;
+	size_t size;
+	struct bank_header *header;
+	struct bank_entry *entries;
+} bank;
+static int num_from_bank;
+
+static void open_sound_bank(void)
+{
+	struct stat stat_buf;
+	struct bank_entry *entry;
+	uint64_t index_end;
+	uint32_t i;
+	int fd;
+
+	if (audio.sound_bank == NULL)
+		return;
+	fd = open((char *)audio.sound_bank, O_RDONLY);
+	if (fd < 0 || fstat(fd, &stat_buf) < 0) {
+		fprintf(stderr, "WARNING: Unable to open sound bank %s: %s\n", audio.sound_bank, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	/* private and writable, as FMOD may touch the padding around each sound */
+	bank.size = stat_buf.st_size;
+	bank.base = mmap(NULL, bank.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (bank.base == MAP_FAILED) {
+		fprintf(stderr, "WARNING: Unable to map sound bank %s: %s\n", audio.sound_bank, strerror(errno));
+		bank.base = NULL;
+		return;
+	}
+
+	bank.header = (struct bank_header *)bank.base;
+	bank.entries = (struct bank_entry *)(bank.header + 1);
+	if (bank.size < sizeof(struct bank_header) ||
+	    memcmp(bank.header->magic, BANK_MAGIC, sizeof(BANK_MAGIC)) != 0 ||
+	    bank.header->version != BANK_VERSION ||
+	    bank.header->sample_rate < BANK_MIN_RATE || bank.header->sample_rate > BANK_MAX_RATE ||
+	    bank.header->num_entries > (bank.size - sizeof(struct bank_header)) / sizeof(struct bank_entry))
+		goto bad_bank;
+	/*
+	 * The samples, and the padding FMOD may touch on either side of them,
+	 * have to be inside the mapping and clear of the header and index.
+	 */
+	index_end = sizeof(struct bank_header) + bank.header->num_entries * sizeof(struct bank_entry);
+	for (i = 0; i < bank.header->num_entries; i++) {
+		entry = &bank.entries[i];
+		if (entry->name_offset < index_end || entry->name_offset >= bank.size ||
+		    memchr(bank.base + entry->name_offset, '\0', bank.size - entry->name_offset) == NULL ||
+		    entry->channels < 1 || entry->channels > BANK_MAX_CHANNELS ||
+		    entry->data_offset % BANK_ALIGN != 0 ||
+		    entry->data_offset < index_end + BANK_PAD || entry->data_offset > bank.size ||
+		    entry->data_length == 0 || entry->data_length % (entry->channels * sizeof(int16_t)) != 0 ||
+		    entry->data_length > bank.size - entry->data_offset ||
+		    BANK_PAD > bank.size - entry->data_offset - entry->data_length)
+			goto bad_bank;
+	}
+	printf("Using sound bank %s with %u sounds at %u Hz\n", audio.sound_bank,
+			bank.header->num_entries, bank.header->sample_rate);
+	return;
+
+bad_bank:
+	fprintf(stderr, "WARNING: %s is not a usable sound bank, rebuild it with --build-bank\n", audio.sound_bank);
+	munmap(bank.base, bank.size);
+	bank.base = NULL;
+}
+
+/*
+ * The bank's copy of a sound file, if it has one that is up to date.
+ * The bank only holds PCM, so sounds that are to be kept compressed or
+ * streamed are always loaded from their files.
+ */
+static struct bank_entry *find_bank_entry(const struct sound_data *data)
+{
+	uint32_t i;
+
+	if (bank.base == NULL || data->storage != STORAGE_PCM)
+		return NULL;
+	for (i = 0; i < bank.header->num_entries; i++) {
+		if (bank.entries[i].file_size == (uint64_t)data->size &&
+		    bank.entries[i].file_mtime == (int64_t)data->mtime &&
+		    bank.entries[i].file_mtime_nsec == (uint32_t)data->mtime_nsec &&
+		    strcmp(bank.base + bank.entries[i].name_offset, data->path) == 0)
+			return &bank.entries[i];
+	}
+	return NULL;
+}
+
+/*
+ * Release the least recently used on demand sounds until the cache fits
+ * again.  Sounds that are playing stay, as does the one that just loaded.
+ */
+static void evict_cold_sounds(int keep)
+{
+	struct sound_data *data;
+	FMOD_RESULT result;
+	int i, victim;
+
+	while (sound_cache_used > audio.sound_cache_size * 1024 * 1024) {
+		victim = -1;
+		for (i = 0; i < num_sound_data; i++) {
+			data = &sound_data[i];
+			if (i == keep || !data->in_cache || data->state != SOUND_READY ||
+			    data->num_playing > 0)
+				continue;
+			if (victim < 0 || data->last_used < sound_data[victim].last_used)
+				victim = i;
+		}
+		if (victim < 0)
+			return;
+
+		data = &sound_data[victim];
+		debugmsg("evicting sound file %s\n", data->path);
+		result = FMOD_Sound_Release(data->fmod_sound);
+		ERRCHECK(result);
+		data->state = SOUND_UNLOADED;
+		data->evictions++;
+		data->in_cache = false;
+		sound_cache_used -= data->memory;
+	}
+}
+
+/* Note the defaults of a sound file that has just finished loading */
+static void finish_loading_sound(int data_id)
+{
+	struct sound_data *data = &sound_data[data_id];
+	FMOD_SOUND *fmod_sound = data->fmod_sound;
+	FMOD_RESULT result;
+	float freq;
+
+	result = FMOD_Sound_GetDefaults(fmod_sound, &freq, &data->vol,
+			&data->pan, &data->prio);
+	ERRCHECK(result);
+	data->state = SOUND_READY;
+
+	if (FMOD_Sound_GetMemoryInfo(fmod_sound, FMOD_MEMBITS_ALL, 0, &data->memory, NULL) != FMOD_OK)
+		data->memory = 0;
+	if (on_demand(data)) {
+		data->in_cache = true;
+		sound_cache_used += data->memory;
+		evict_cold_sounds(data_id);
+	}
+}
+
+/*
+ * FMOD_NONBLOCKING hands the opening and decoding to FMOD's background
+ * loader; the dispatcher picks the sound up once it is ready.
+ */
+static void start_loading_sound(FMOD_SYSTEM *system, int data_id)
+{
+	struct sound_data *data = &sound_data[data_id];
+	FMOD_MODE mode = FMOD_SOFTWARE | FMOD_LOOP_OFF | FMOD_NONBLOCKING;
+	FMOD_CREATESOUNDEXINFO exinfo;
+	struct bank_entry *entry;
+	FMOD_RESULT result;
+
+	/* sounds in the bank are ready straight away, there is nothing to decode */
+	entry = find_bank_entry(data);
+	if (entry != NULL) {
+		memset(&exinfo, 0, sizeof(exinfo));
+		exinfo.cbsize = sizeof(exinfo);
+		exinfo.length = entry->data_length;
+		exinfo.numchannels = entry->channels;
+		exinfo.defaultfrequency = bank.header->sample_rate;
+		exinfo.format = FMOD_SOUND_FORMAT_PCM16;
+		result = FMOD_System_CreateSound(system, bank.base + entry->data_offset,
+				FMOD_SOFTWARE | FMOD_LOOP_OFF | FMOD_CREATESAMPLE |
+				FMOD_OPENMEMORY_POINT | FMOD_OPENRAW,
+				&exinfo, &data->fmod_sound);
+		if (result == FMOD_OK) {
+			debugmsg("using the sound bank's copy of %s\n", data->path);
+			data->loads++;
+			num_from_bank++;
+			finish_loading_sound(data_id);
+			return;
+		}
+		fprintf(stderr, "WARNING: Unable to use the sound bank's copy of \"%s\": %s\n",
+				data->path, FMOD_ErrorString(result));
+	}
+
+	if (data->storage == STORAGE_COMPRESSED)
+		mode |= FMOD_CREATECOMPRESSEDSAMPLE;
+	else if (data->storage == STORAGE_STREAM)
+		mode |= FMOD_CREATESTREAM;
+
+	debugmsg("opening sound file %s with storage %d\n", data->path, data->storage);
+	result = FMOD_System_CreateSound(system, data->path, mode, 0, &data->fmod_sound);
+	if (result != FMOD_OK) {
+		fprintf(stderr, "WARNING: Unable to open sound file \"%s\", a beep will play instead: %s\n",
+				data->path, FMOD_ErrorString(result));
+		data->state = SOUND_FAILED;
+		return;
+	}
+	data->state = SOUND_LOADING;
+	data->loads++;
+	num_sounds_loading++;
+}
+
+/*
+ * Work out which sound files a config needs, and how each is to be
+ * stored.  Files that are already loaded, for an earlier config, are
+ * reused.  A file that has gone missing since the config was checked
+ * plays a beep.  This is done by the thread that loaded the config,
+ * before it is handed to the dispatcher, which only has to load them.
+ */
+static void resolve_sound_files(struct config *cfg)
+{
+	struct stat stat_buf;
+	char path[PATH_MAX];
+	/* the sounds aren't loaded yet, so budget by their (compressed) file sizes */
+	unsigned long memory_estimate = 0;
+	enum sound_storage storage;
+	struct sound *sound;
+	int i, data_id;
+
+	for (i = 0; i < cfg->num_sounds; i++)
+		cfg->sounds[i].data_id = -1;
+	pthread_mutex_lock(&sound_data_lock);
+	resolving_config = cfg;
+	pthread_mutex_unlock(&sound_data_lock);
+
+	for (i = 0; i < cfg->num_sounds; i++) {
+		sound = &cfg->sounds[i];
+		if (realpath((char *)sound->file, path) == NULL || stat(path, &stat_buf) < 0) {
+			snprintf(path, sizeof(path), "%s", (char *)sound->file);
+			memset(&stat_buf, 0, sizeof(stat_buf));
+		}
+
+		storage = choose_storage(sound, stat_buf.st_size, memory_estimate);
+		/* a stream has one file handle and buffer, so it can only play once at a time */
+		if (storage == STORAGE_STREAM)
+			sound->max_polyphony = 1;
+		pthread_mutex_lock(&sound_data_lock);
+		data_id = find_sound_data(sound, path, &stat_buf, storage);
+		if (sound_data[data_id].state == SOUND_UNLOADED && storage != STORAGE_STREAM)
+			memory_estimate += stat_buf.st_size;
+		pthread_mutex_unlock(&sound_data_lock);
+		sound->num_playing = 0;
+		sound->plays = 0;
+	}
+}
+
+/* Start loading every sound file a config needs that isn't loaded on demand */
+static void start_loading_sounds(FMOD_SYSTEM *system, struct config *cfg)
+{
+	int i;
+
+	for (i = 0; i < num_sound_data; i++)
+		sound_data[i].preload = false;
+	for (i = 0; i < cfg->num_sounds; i++)
+		sound_data[cfg->sounds[i].data_id].preload |= cfg->sounds[i].preload;
+	for (i = 0; i < cfg->num_sounds; i++) {
+		struct sound_data *data = &sound_data[cfg->sounds[i].data_id];
+
+		if (data->state == SOUND_UNLOADED && !on_demand(data))
+			start_loading_sound(system, cfg->sounds[i].data_id);
+	}
+}
+
+/* Play what was triggered while an on demand sound was loading */
+static void play_pending_sounds(FMOD_SYSTEM *system, struct sound_data *data)
+{
+	int i;
+
+	for (i = 0; i < data->num_pending; i++) {
+		if (!event_expired(&data->pending[i]))
+			play_sound(system, data->pending[i].config, data->pending[i].sound_id);
+		put_config(data->pending[i].config);
+	}
+	data->num_pending = 0;
+}
+
+/* Called by the dispatcher to pick up the sounds that finished loading */
+static void poll_loading_sounds(FMOD_SYSTEM *system)
+{
+	struct sound_data *data;
+	FMOD_OPENSTATE state;
+	FMOD_RESULT result;
+	unsigned long memory_used = 0;
+	int num_stored[STORAGE_STREAM + 1] = { 0 };
+	int i, num_loaded = 0, num_files = 0;
+	bool *counted;
+
+	for (i = 0; i < num_sound_data; i++) {
+		data = &sound_data[i];
+		if (data->state != SOUND_LOADING)
+			continue;
+		result = FMOD_Sound_GetOpenState(data->fmod_sound, &state, NULL, NULL);
+		if (result != FMOD_OK || state == FMOD_OPENSTATE_ERROR) {
+			fprintf(stderr, "WARNING: Unable to load sound file \"%s\", a beep will play instead: %s\n",
+					data->path, FMOD_ErrorString(result));
+			data->state = SOUND_FAILED;
+			num_sounds_loading--;
+		} else if (state == FMOD_OPENSTATE_READY) {
+			debugmsg("sound file %s is ready\n", data->path);
+			num_sounds_loading--;
+			finish_loading_sound(i);
+		} else {
+			continue;
+		}
+		play_pending_sounds(system, data);
+	}
+	if (num_sounds_loading > 0 || sounds_reported)
+		return;
+
+	/* only count the files the current config uses */
+	counted = calloc(num_sound_data, sizeof(bool));
+	for (i = 0; i < config->num_sounds; i++) {
+		data = &sound_data[config->sounds[i].data_id];
+		if (counted[config->sounds[i].data_id])
+			continue;
+		counted[config->sounds[i].data_id] = true;
+		num_files++;
+		if (data->state == SOUND_READY) {
+			num_loaded++;
+			num_stored[data->storage]++;
+			memory_used += data->memory;
+		}
+	}
+	free(counted);
+	printf("Loaded %d sound files for %d sounds (%d PCM, %d compressed, %d streamed) using %lu KB",
+			num_loaded, config->num_sounds, num_stored[STORAGE_PCM], num_stored[STORAGE_COMPRESSED],
+			num_stored[STORAGE_STREAM], memory_used / 1024);
+	if (num_from_bank > 0)
+		printf(", %d from the sound bank", num_from_bank);
+	if (num_loaded < num_files)
+		printf(", %d more load on demand", num_files - num_loaded);
+	printf("\n");
+	sounds_reported = true;
+}
+
+/*
+ * Play a sound for the dispatcher.  An on demand sound that isn't loaded
+ * yet starts loading, and the events for it wait for it instead of
+ * beeping.
+ */
+static void request_sound(FMOD_SYSTEM *system, const struct event_buffer_entry *event)
+{
+	struct sound *sound = &event->config->sounds[event->sound_id];
+	struct sound_data *data = &sound_data[sound->data_id];
+
+	sound->plays++;
+	data->last_used = now_ns();
+	if (data->state == SOUND_UNLOADED)
+		start_loading_sound(system, sound->data_id);
+	if (data->state == SOUND_LOADING && on_demand(data)) {
+		data->pending = grow_array(data->pending, data->num_pending, sizeof(struct event_buffer_entry));
+		data->pending[data->num_pending++] = *event;
+		hold_config(event->config);
+		return;
+	}
+	play_sound(system, event->config, event->sound_id);
+}
+
+static volatile sig_atomic_t sound_stats_requested;
+
+static void request_sound_stats(int sig)
+{
+	sound_stats_requested = 1;
+}
+
+static int compare_sound_plays(const void *a, const void *b)
+{
+	unsigned long plays_a = config->sounds[*(const int *)a].plays;
+	unsigned long plays_b = config->sounds[*(const int *)b].plays;
+
+	return plays_a < plays_b ? 1 : plays_a > plays_b ? -1 : 0;
+}
+
+/* Print how often each sound is used (on SIGUSR1), to help pick which to <preload/> */
+static void print_sound_stats(void)
+{
+	static const char *state_names[] = { "unloaded", "loading", "ready", "failed" };
+	int *order = malloc(sizeof(int) * config->num_sounds);
+	int i;
+
+	for (i = 0; i < config->num_sounds; i++)
+		order[i] = i;
+	qsort(order, config->num_sounds, sizeof(int), compare_sound_plays);
+
+	if (audio.sound_cache_size > 0)
+		printf("Sound usage (%lu KB of the %ld MB cache used):\n", sound_cache_used / 1024,
+				audio.sound_cache_size);
+	else
+		printf("Sound usage:\n");
+	for (i = 0; i < config->num_sounds; i++) {
+		struct sound *sound = &config->sounds[order[i]];
+		struct sound_data *data = &sound_data[sound->data_id];
+
+		/* the loads, evictions and memory are for the file, which may be shared */
+		printf("  %-24s %-8s %8lu plays %4lu loads %4lu evictions %6u KB%s\n",
+				(char *)sound->name, state_names[data->state], sound->plays,
+				data->loads, data->evictions, data->memory / 1024,
+				data->preload ? " (preload)" : "");
+	}
+	fflush(stdout);
+	free(order);
+}
+
+/* A short 880 Hz tone, made in memory so it is ready as soon as FMOD is */
+static void create_default_beep(FMOD_SYSTEM *system)
+{
+	FMOD_CREATESOUNDEXINFO exinfo;
+	FMOD_RESULT result;
+	const int rate = 22050, samples = rate / 8;
+	int16_t *pcm;
+	int i;
+
+	pcm = malloc(samples * sizeof(int16_t));
+	for (i = 0; i < samples; i++) {
+		/* fade in and out over 5 ms to avoid clicks */
+		double envelope = fmin(1.0, fmin(i, samples - i) / (rate / 200.0));
+		pcm[i] = (int16_t)(12000 * envelope * sin(2 * M_PI * 880 * i / rate));
+	}
+
+	memset(&exinfo, 0, sizeof(exinfo));
+	exinfo.cbsize = sizeof(exinfo);
+	exinfo.length = samples * sizeof(int16_t);
+	exinfo.numchannels = 1;
+	exinfo.defaultfrequency = rate;
+	exinfo.format = FMOD_SOUND_FORMAT_PCM16;
+	result = FMOD_System_CreateSound(system, (char *)pcm,
+			FMOD_SOFTWARE | FMOD_LOOP_OFF | FMOD_OPENMEMORY | FMOD_OPENRAW,
+			&exinfo, &default_beep);
+	ERRCHECK(result);
+	/* FMOD_OPENMEMORY made its own copy */
+	free(pcm);
+}
+
+static bool start_logwatcher(const xmlChar *name)
+{
+	struct log_file_info *lw = malloc(sizeof(struct log_file_info));
+	int ret;
+
+	lw->file = fopen((char *)name, "r");
+	if (lw->file == NULL) {
+		fprintf(stderr, "Unable to open logfile \"%s\": %s\n", name, strerror(errno));
+		free(lw);
+		return false;
+	}
+	lw->name = xmlStrdup(name);
+	atomic_init(&lw->stop, false);
+	ret = pthread_create(&lw->thread, NULL, logwatcher, lw);
+	if (ret != 0) {
+		fprintf(stderr, "Unable to create logwatcher pthread for log file %s\n", name);
+		exit(1);
+	}
+	pthread_detach(lw->thread);
+	lw->next = logwatchers;
+	logwatchers = lw;
+	return true;
+}
+
+/*
+ * Stop watching the log files that aren't in a config any more.  This is
+ * done before the config is installed, so that a logwatcher never reads
+ * a line against a config without its log file.  A logwatcher that is
+ * stopped notices before its log's next line, or within 10 ms if it is
+ * waiting for one.
+ */
+static void stop_dropped_logwatchers(const struct config *cfg)
+{
+	struct log_file_info **lwp, *lw;
+
+	for (lwp = &logwatchers; (lw = *lwp) != NULL; ) {
+		if (find_logfile(cfg, lw->name) < 0) {
+			debugmsg("stopping the logwatcher for %s\n", lw->name);
+			*lwp = lw->next;
+			atomic_store(&lw->stop, true);
+		} else {
+			lwp = &lw->next;
+		}
+	}
+}
+
+/*
+ * Start watching the log files that are new in a config, once it is
+ * installed.  Returns false if a log file couldn't be opened.
+ */
+static bool update_logwatchers(const struct config *cfg)
+{
+	struct log_file_info *lw;
+	bool ok = true;
+	int i;
+
+	stop_dropped_logwatchers(cfg);
+	for (i = 0; i < cfg->num_logfiles; i++) {
+		for (lw = logwatchers; lw != NULL; lw = lw->next) {
+			if (xmlStrEqual(lw->name, cfg->logfiles[i].file))
+				break;
+		}
+		if (lw == NULL && !start_logwatcher(cfg->logfiles[i].file))
+			ok = false;
+	}
+	return ok;
+}
+
+/*
+ * Open-addressed index of sound, trigger or logfile names, so resolving
+ * the references in a config with thousands of triggers doesn't take a
+ * pass over all of them per reference.
+ */
+struct name_index {
+	const xmlChar **names;
+	int *ids;
+	unsigned mask;
+};
+
+static uint64_t hash_name(const xmlChar *name)
+{
+	return hash_bytes(FNV_OFFSET_BASIS, name, xmlStrlen(name));
+}
+
+static void init_name_index(struct name_index *idx, int count)
+{
+	unsigned size = 16;
+
+	/* kept at most half full */
+	while (size < (unsigned)count * 2)
+		size *= 2;
+	idx->names = calloc(size, sizeof(xmlChar *));
+	idx->ids = malloc(size * sizeof(int));
+	idx->mask = size - 1;
+}
+
+static void free_name_index(struct name_index *idx)
+{
+	free(idx->names);
+	free(idx->ids);
+}
+
+/* The slot holding name, or the empty one it would go in */
+static unsigned name_index_slot(const struct name_index *idx, const xmlChar *name)
+{
+	unsigned i = hash_name(name) & idx->mask;
+
+	while (idx->names[i] != NULL && !xmlStrEqual(idx->names[i], name))
+		i = (i + 1) & idx->mask;
+	return i;
+}
+
+/* Returns the id already indexed under name, or -1 once it has been added */
+static int add_to_name_index(struct name_index *idx, const xmlChar *name, int id)
+{
+	unsigned i = name_index_slot(idx, name);
+
+	if (idx->names[i] != NULL)
+		return idx->ids[i];
+	idx->names[i] = name;
+	idx->ids[i] = id;
+	return -1;
+}
+
+static int find_in_name_index(const struct name_index *idx, const xmlChar *name)
+{
+	unsigned i = name_index_slot(idx, name);
+
+	return idx->names[i] != NULL ? idx->ids[i] : -1;
+}
+
+static void match_triggers_with_sounds(void)
+{
+	struct name_index sound_names;
+	int i;
+
+	init_name_index(&sound_names, loading->num_sounds);
+	for (i = 0; i < loading->num_sounds; i++) {
+		if (add_to_name_index(&sound_names, loading->sounds[i].name, i) >= 0) {
+			fprintf(stderr, "Duplicate sound name: %s\n", loading->sounds[i].name);
+			free_name_index(&sound_names);
+			config_error();
+		}
+	}
+
+	for (i = 0; i < loading->num_triggers; i++) {
+		if (loading->triggers[i].sound_to_play == NULL) {
+			loading->triggers[i].sound_to_play_id = NO_SOUND;
+			continue;
+		}
+		loading->triggers[i].sound_to_play_id = find_in_name_index(&sound_names, loading->triggers[i].sound_to_play);
+		if (loading->triggers[i].sound_to_play_id < 0) {
+			fprintf(stderr, "Unable to find sound: %s for trigger: %s\n", loading->triggers[i].sound_to_play, loading->triggers[i].name);
+			free_name_index(&sound_names);
+			config_error();
+		}
+	}
+	free_name_index(&sound_names);
+}
+
+static void match_logfiles_with_triggers(void)
+{
+	struct name_index trigger_names, logfile_names;
+	struct attached_trigger *at;
+	int i, j;
+
+	init_name_index(&trigger_names, loading->num_triggers);
+	for (i = 0; i < loading->num_triggers; i++) {
+		if (add_to_name_index(&trigger_names, loading->triggers[i].name, i) >= 0) {
+			fprintf(stderr, "Duplicate trigger name: %s\n", loading->triggers[i].name);
+			free_name_index(&trigger_names);
+			config_error();
+		}
+	}
+
+	/* the logwatchers are looked up by file, so each may only be listed once */
+	init_name_index(&logfile_names, loading->num_logfiles);
+	for (i = 0; i < loading->num_logfiles; i++) {
+		if (add_to_name_index(&logfile_names, loading->logfiles[i].file, i) >= 0) {
+			fprintf(stderr, "Duplicate logfile: %s\n", loading->logfiles[i].file);
+			free_name_index(&trigger_names);
+			free_name_index(&logfile_names);
+			config_error();
+		}
+		for (j = 0; j < loading->logfiles[i].num_attached_triggers; j++) {
+			at = &loading->logfiles[i].attached_triggers[j];
+			at->trigger_id = find_in_name_index(&trigger_names, at->name);
+			if (at->trigger_id < 0) {
+				fprintf(stderr, "Unable to find trigger: %s for logfile: %s\n", at->name, loading->logfiles[i].file);
+				free_name_index(&trigger_names);
+				free_name_index(&logfile_names);
+				config_error();
+			}
+		}
+	}
+	free_name_index(&trigger_names);
+	free_name_index(&logfile_names);
+}
+
+/*
+ * The groups in a list such as "pot, pok" of a trigger's, as a mask of
+ * group_ids.  The index is freed if the list names a group it doesn't have.
+ */
+static uint64_t group_list_mask(struct name_index *group_names, const xmlChar *list,
+		const struct trigger *trigger)
+{
+	char *copy, *name, *save;
+	uint64_t mask = 0;
+	int id;
+
+	if (list == NULL)
+		return 0;
+	copy = strdup((char *)list);
+	for (name = strtok_r(copy, ", \t\n", &save); name != NULL; name = strtok_r(NULL, ", \t\n", &save)) {
+		id = find_in_name_index(group_names, (xmlChar *)name);
+		if (id < 0) {
+			fprintf(stderr, "Unable to find trigger group: %s for trigger: %s\n", name, trigger->name);
+			free(copy);
+			free_name_index(group_names);
+			config_error();
+		}
+		mask |= 1ULL << id;
+	}
+	free(copy);
+	return mask;
+}
+
+/* Number the trigger groups, and resolve the groups triggers turn on and off */
+static void match_trigger_groups(void)
+{
+	struct name_index group_names;
+	struct trigger *trigger;
+	int i;
+
+	init_name_index(&group_names, loading->num_triggers);
+	for (i = 0; i < loading->num_triggers; i++) {
+		trigger = &loading->triggers[i];
+		if (trigger->group == NULL) {
+			trigger->group_id = NO_GROUP;
+			continue;
+		}
+		trigger->group_id = find_in_name_index(&group_names, trigger->group);
+		if (trigger->group_id >= 0)
+			continue;
+		if (loading->num_groups == MAX_TRIGGER_GROUPS) {
+			fprintf(stderr, "Too many trigger groups, the most there can be is %d\n", MAX_TRIGGER_GROUPS);
+			free_name_index(&group_names);
+			config_error();
+		}
+		trigger->group_id = loading->num_groups;
+		add_to_name_index(&group_names, trigger->group, trigger->group_id);
+		loading->group_names = grow_array(loading->group_names, loading->num_groups, sizeof(xmlChar *));
+		loading->group_names[loading->num_groups++] = trigger->group;
+	}
+
+	for (i = 0; i < loading->num_triggers; i++) {
+		trigger = &loading->triggers[i];
+		trigger->enables = group_list_mask(&group_names, trigger->enable_groups, trigger);
+		trigger->disables = group_list_mask(&group_names, trigger->disable_groups, trigger);
+	}
+	free_name_index(&group_names);
+}
+
+/* Catch missing sound files when the config is loaded rather than when they are first triggered */
+static void check_sound_files(void)
+{
+	int i;
+
+	for (i = 0; i < loading->num_sounds; i++) {
+		if (access((char *)loading->sounds[i].file, R_OK) < 0) {
+			fprintf(stderr, "Unable to open sound file \"%s\": %s\n", loading->sounds[i].file, strerror(errno));
+			config_error();
+		}
+	}
+}
+
+static void free_config(struct config *cfg);
+
+/*
+ * Once a config has been read, it is packed into one block of memory, its
+ * arena, and later freed as a unit.  What the logwatchers go through for
+ * every log line comes first, in the order they use it: the logfiles and
+ * their trigger tables, then what a match needs, the attached triggers and
+ * the triggers.  Each string is stored once however often it is used, so a trigger's
+ * sound_to_play is the sound's own name.
+ */
+#define ARENA_ALIGN 8
+
+struct arena {
+	char *base;
+	size_t size, used;
+	struct name_index strings;	/* the offset of each string stored so far */
+};
+
+static void *arena_alloc(struct arena *arena, size_t size)
+{
+	void *p;
+
+	arena->used = (arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	assert(arena->used + size <= arena->size);
+	p = arena->base + arena->used;
+	arena->used += size;
+	return p;
+}
+
+static void *arena_copy(struct arena *arena, const void *src, size_t size)
+{
+	void *p = arena_alloc(arena, size);
+
+	if (size > 0)
+		memcpy(p, src, size);
+	return p;
+}
+
+static xmlChar *arena_string(struct arena *arena, const xmlChar *str)
+{
+	int offset;
+	size_t len;
+
+	if (str == NULL)
+		return NULL;
+	offset = find_in_name_index(&arena->strings, str);
+	if (offset < 0) {
+		len = xmlStrlen(str) + 1;
+		assert(arena->used + len <= arena->size);
+		offset = arena->used;
+		memcpy(arena->base + offset, str, len);
+		arena->used += len;
+		add_to_name_index(&arena->strings, (xmlChar *)arena->base + offset, offset);
+	}
+	return (xmlChar *)arena->base + offset;
+}
+
+/* Free what a config that isn't packed yet allocated piece by piece */
+static void free_config_parts(struct config *cfg)
+{
+	int i, j;
+
+	if (cfg->borrowed) {
+		for (i = 0; i < cfg->num_logfiles; i++)
+			free(cfg->logfiles[i].attached_triggers);
+		free(cfg->sounds);
+		free(cfg->triggers);
+		free(cfg->logfiles);
+		free(cfg->group_names);
+		return;
+	}
+	for (i = 0; i < cfg->num_sounds; i++) {
+		xmlFree(cfg->sounds[i].name);
+		xmlFree(cfg->sounds[i].file);
+	}
+	for (i = 0; i < cfg->num_triggers; i++) {
+		xmlFree(cfg->triggers[i].name);
+		xmlFree(cfg->triggers[i].pattern);
+		xmlFree(cfg->triggers[i].sound_to_play);
+		xmlFree(cfg->triggers[i].group);
+		xmlFree(cfg->triggers[i].enable_groups);
+		xmlFree(cfg->triggers[i].disable_groups);
+	}
+	for (i = 0; i < cfg->num_logfiles; i++) {
+		for (j = 0; j < cfg->logfiles[i].num_attached_triggers; j++)
+			xmlFree(cfg->logfiles[i].attached_triggers[j].name);
+		free(cfg->logfiles[i].attached_triggers);
+		xmlFree(cfg->logfiles[i].file);
+	}
+	for (i = 0; i < cfg->num_includes; i++)
+		xmlFree(cfg->includes[i]);
+	for (i = 0; i < cfg->num_imports; i++) {
+		xmlFree(cfg->imports[i].path);
+		xmlFree(cfg->imports[i].sound_dir);
+	}
+	free(cfg->sounds);
+	free(cfg->triggers);
+	free(cfg->logfiles);
+	free(cfg->group_names);	/* the names are the triggers' */
+	free(cfg->includes);
+	free(cfg->imports);
+}
+
+/* Arena space for the trigger table of a logfile with n attached triggers */
+#define TRIGGER_TABLE_SIZE(n) ((n) * (2 * sizeof(unsigned int) + 3 * sizeof(int) + 3) + 9 * ARENA_ALIGN)
+
+/* Compile logfile's trigger table, which takes patterns_size bytes of patterns */
+static void build_trigger_table(struct arena *arena, const struct config *cfg, struct logfile *logfile,
+		unsigned int patterns_size)
+{
+	struct trigger_table *table = &logfile->table;
+	const struct attached_trigger *at;
+	const struct trigger *trigger;
+	unsigned int offset = 0, len, k;
+	int n = logfile->num_attached_triggers, i;
+
+	table->count = n;
+	table->pattern_len = arena_alloc(arena, sizeof(unsigned int) * n);
+	table->first_byte = arena_alloc(arena, n);
+	table->pattern_offset = arena_alloc(arena, sizeof(unsigned int) * n);
+	table->trigger_id = arena_alloc(arena, sizeof(int) * n);
+	table->sound_id = arena_alloc(arena, sizeof(int) * n);
+	table->stop_search_on_match = arena_alloc(arena, sizeof(bool) * n);
+	table->attached = arena_alloc(arena, sizeof(int) * n);
+	table->group = arena_alloc(arena, n);
+	table->groups_used = 0;
+	table->patterns = arena_alloc(arena, patterns_size);
+	table->patterns_size = patterns_size;
+	for (i = 0; i < n; i++) {
+		at = &logfile->attached_triggers[i];
+		trigger = &cfg->triggers[at->trigger_id];
+		len = xmlStrlen(trigger->pattern);
+		for (k = 0; k < len; k++)
+			table->patterns[offset + k] = tolower(trigger->pattern[k]);
+		table->patterns[offset + len] = '\0';
+		table->pattern_len[i] = len;
+		table->first_byte[i] = table->patterns[offset];
+		table->pattern_offset[i] = offset;
+		table->trigger_id[i] = at->trigger_id;
+		table->sound_id[i] = trigger->sound_to_play_id;
+		table->stop_search_on_match[i] = at->stop_search_on_match;
+		table->attached[i] = i;
+		table->group[i] = trigger->group_id;
+		if (trigger->group_id != NO_GROUP)
+			table->groups_used |= 1ULL << trigger->group_id;
+		offset += len + 1;
+	}
+}
+
+/* The space the patterns in a logfile's trigger table take */
+static unsigned int trigger_table_patterns_size(const struct config *cfg, const struct logfile *logfile)
+{
+	unsigned int size = 0;
+	int i;
+
+	for (i = 0; i < logfile->num_attached_triggers; i++)
+		size += xmlStrlen(cfg->triggers[logfile->attached_triggers[i].trigger_id].pattern) + 1;
+	return size;
+}
+
+static void pack_config(struct config *cfg)
+{
+	struct arena arena;
+	struct sound *sounds;
+	struct trigger *triggers;
+	struct logfile *logfiles;
+	xmlChar **group_names;
+	int i, j, num_strings = 0;
+
+	/* room for everything, assuming no string is shared */
+	arena.size = sizeof(struct sound) * cfg->num_sounds + sizeof(struct trigger) * cfg->num_triggers +
+		sizeof(struct logfile) * cfg->num_logfiles + ARENA_ALIGN * (cfg->num_logfiles + 3);
+	for (i = 0; i < cfg->num_sounds; i++) {
+		arena.size += xmlStrlen(cfg->sounds[i].name) + xmlStrlen(cfg->sounds[i].file) + 2;
+		num_strings += 2;
+	}
+	for (i = 0; i < cfg->num_triggers; i++) {
+		arena.size += xmlStrlen(cfg->triggers[i].name) + xmlStrlen(cfg->triggers[i].pattern) +
+			xmlStrlen(cfg->triggers[i].sound_to_play) + xmlStrlen(cfg->triggers[i].group) +
+			xmlStrlen(cfg->triggers[i].enable_groups) + xmlStrlen(cfg->triggers[i].disable_groups) + 6;
+		num_strings += 6;
+	}
+	arena.size += sizeof(xmlChar *) * cfg->num_groups + ARENA_ALIGN;
+	for (i = 0; i < cfg->num_logfiles; i++) {
+		arena.size += xmlStrlen(cfg->logfiles[i].file) + 1;
+		arena.size += sizeof(struct attached_trigger) * cfg->logfiles[i].num_attached_triggers;
+		arena.size += TRIGGER_TABLE_SIZE(cfg->logfiles[i].num_attached_triggers) +
+			trigger_table_patterns_size(cfg, &cfg->logfiles[i]);
+		for (j = 0; j < cfg->logfiles[i].num_attached_triggers; j++)
+			arena.size += xmlStrlen(cfg->logfiles[i].attached_triggers[j].name) + 1;
+		num_strings += 1 + cfg->logfiles[i].num_attached_triggers;
+	}
+	arena.base = malloc(arena.size);
+	arena.used = 0;
+	init_name_index(&arena.strings, num_strings);
+
+	logfiles = arena_copy(&arena, cfg->logfiles, sizeof(struct logfile) * cfg->num_logfiles);
+	for (i = 0; i < cfg->num_logfiles; i++) {
+		build_trigger_table(&arena, cfg, &logfiles[i], trigger_table_patterns_size(cfg, &logfiles[i]));
+		logfiles[i].attached_triggers = arena_copy(&arena, cfg->logfiles[i].attached_triggers,
+				sizeof(struct attached_trigger) * cfg->logfiles[i].num_attached_triggers);
+	}
+	triggers = arena_copy(&arena, cfg->triggers, sizeof(struct trigger) * cfg->num_triggers);
+	for (i = 0; i < cfg->num_triggers; i++)
+		triggers[i].pattern = arena_string(&arena, cfg->triggers[i].pattern);
+	sounds = arena_copy(&arena, cfg->sounds, sizeof(struct sound) * cfg->num_sounds);
+	for (i = 0; i < cfg->num_sounds; i++) {
+		sounds[i].name = arena_string(&arena, cfg->sounds[i].name);
+		sounds[i].file = arena_string(&arena, cfg->sounds[i].file);
+	}
+	for (i = 0; i < cfg->num_triggers; i++) {
+		triggers[i].name = arena_string(&arena, cfg->triggers[i].name);
+		triggers[i].sound_to_play = arena_string(&arena, cfg->triggers[i].sound_to_play);
+		triggers[i].group = arena_string(&arena, cfg->triggers[i].group);
+		triggers[i].enable_groups = arena_string(&arena, cfg->triggers[i].enable_groups);
+		triggers[i].disable_groups = arena_string(&arena, cfg->triggers[i].disable_groups);
+	}
+	group_names = arena_alloc(&arena, sizeof(xmlChar *) * cfg->num_groups);
+	for (i = 0; i < cfg->num_groups; i++)
+		group_names[i] = arena_string(&arena, cfg->group_names[i]);
+	for (i = 0; i < cfg->num_logfiles; i++) {
+		logfiles[i].file = arena_string(&arena, cfg->logfiles[i].file);
+		for (j = 0; j < logfiles[i].num_attached_triggers; j++)
+			logfiles[i].attached_triggers[j].name = arena_string(&arena, logfiles[i].attached_triggers[j].name);
+	}
+	free_name_index(&arena.strings);
+
+	free_config_parts(cfg);
+	cfg->sounds = sounds;
+	cfg->triggers = triggers;
+	cfg->logfiles = logfiles;
+	cfg->group_names = group_names;
+	cfg->arena = arena.base;
+	cfg->arena_size = arena.used;
+}
+
+/*
+ * atconfig.bin, written by --compile, is a packed config's arena as it is
+ * in memory, but with offsets into the file in place of pointers.
+ * Loading it is a matter of mapping it and fixing up the pointers, which
+ * is much quicker than reading the XML.  It is laid out as a
+ * config_cache_header, the arena, a config_cache_include for each trigger
+ * pack, and then the <audio> strings and the packs' paths.  It is only
+ * used while atconfig.xml and the packs are the size and have the
+ * modification time they were compiled from.
+ */
+#define CONFIG_CACHE "atconfig.bin"
+#define CACHE_MAGIC "ATCONFIG"
+#define CACHE_VERSION 5
+struct config_cache_header {
+	char magic[8];
+	uint32_t version;
+	/* a build with different struct layouts can't use the file */
+	uint32_t sizes[5];
+	int64_t source_size;
+	int64_t source_mtime_sec;
+	int64_t source_mtime_nsec;
+	int32_t num_sounds;
+	int32_t num_triggers;
+	int32_t num_logfiles;
+	int32_t num_includes;
+	uint64_t arena_offset, arena_size;
+	uint64_t sounds_offset, triggers_offset, logfiles_offset;
+	uint64_t includes_offset;
+	int64_t num_groups;
+	uint64_t group_names_offset;
+	struct runtime runtime;
+	struct audio_settings audio;
+};
+struct config_cache_include {
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t path_offset;
+};
+
+static void get_cache_struct_sizes(uint32_t *sizes)
+{
+	sizes[0] = sizeof(struct config_cache_header);
+	sizes[1] = sizeof(struct sound);
+	sizes[2] = sizeof(struct trigger);
+	sizes[3] = sizeof(struct logfile);
+	sizes[4] = sizeof(struct attached_trigger);
+}
+
+/* The arena starts right after the header, which keeps it aligned */
+#define CACHE_ARENA_OFFSET (((sizeof(struct config_cache_header) + ARENA_ALIGN - 1) / ARENA_ALIGN) * ARENA_ALIGN)
+
+/* Where a pointer into cfg's arena ends up in atconfig.bin, as a pointer */
+static void *cache_offset(const struct config *cfg, const void *p)
+{
+	if (p == NULL)
+		return NULL;
+	return (void *)(uintptr_t)((const char *)p - cfg->arena + CACHE_ARENA_OFFSET);
+}
+
+/* Write cfg, and the <runtime> and <audio> settings, to atconfig.bin */
+static void compile_config(const struct config *cfg)
+{
+	static const char padding[ARENA_ALIGN];
+	struct config_cache_header header;
+	char *copy;
+	struct sound *sounds;
+	struct trigger *triggers;
+	struct logfile *logfiles;
+	struct attached_trigger *at;
+	struct trigger_table *table;
+	xmlChar **group_names;
+	struct config_cache_include *includes;
+	struct config_file *file;
+	uint64_t offset;
+	FILE *f;
+	int i, j;
+
+	/* a copy of the arena, to turn its pointers into offsets in */
+	copy = malloc(cfg->arena_size);
+	memcpy(copy, cfg->arena, cfg->arena_size);
+	sounds = (struct sound *)(copy + ((char *)cfg->sounds - cfg->arena));
+	triggers = (struct trigger *)(copy + ((char *)cfg->triggers - cfg->arena));
+	logfiles = (struct logfile *)(copy + ((char *)cfg->logfiles - cfg->arena));
+	for (i = 0; i < cfg->num_sounds; i++) {
+		sounds[i].name = cache_offset(cfg, sounds[i].name);
+		sounds[i].file = cache_offset(cfg, sounds[i].file);
+		/* set up when the config is installed */
+		sounds[i].data_id = 0;
+		sounds[i].num_playing = 0;
+		sounds[i].plays = 0;
+	}
+	for (i = 0; i < cfg->num_triggers; i++) {
+		triggers[i].name = cache_offset(cfg, triggers[i].name);
+		triggers[i].pattern = cache_offset(cfg, triggers[i].pattern);
+		triggers[i].sound_to_play = cache_offset(cfg, triggers[i].sound_to_play);
+		triggers[i].group = cache_offset(cfg, triggers[i].group);
+		triggers[i].enable_groups = cache_offset(cfg, triggers[i].enable_groups);
+		triggers[i].disable_groups = cache_offset(cfg, triggers[i].disable_groups);
+	}
+	group_names = (xmlChar **)(copy + ((char *)cfg->group_names - cfg->arena));
+	for (i = 0; i < cfg->num_groups; i++)
+		group_names[i] = cache_offset(cfg, group_names[i]);
+	for (i = 0; i < cfg->num_logfiles; i++) {
+		at = (struct attached_trigger *)(copy + ((char *)cfg->logfiles[i].attached_triggers - cfg->arena));
+		for (j = 0; j < logfiles[i].num_attached_triggers; j++)
+			at[j].name = cache_offset(cfg, at[j].name);
+		logfiles[i].file = cache_offset(cfg, logfiles[i].file);
+		logfiles[i].attached_triggers = cache_offset(cfg, cfg->logfiles[i].attached_triggers);
+		table = &logfiles[i].table;
+		table->pattern_len = cache_offset(cfg, table->pattern_len);
+		table->first_byte = cache_offset(cfg, table->first_byte);
+		table->pattern_offset = cache_offset(cfg, table->pattern_offset);
+		table->trigger_id = cache_offset(cfg, table->trigger_id);
+		table->sound_id = cache_offset(cfg, table->sound_id);
+		table->stop_search_on_match = cache_offset(cfg, table->stop_search_on_match);
+		table->attached = cache_offset(cfg, table->attached);
+		table->group = cache_offset(cfg, table->group);
+		table->patterns = cache_offset(cfg, table->patterns);
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.version = CACHE_VERSION;
+	get_cache_struct_sizes(header.sizes);
+	header.source_size = config_files->stat.st_size;
+	header.source_mtime_sec = config_files->stat.st_mtim.tv_sec;
+	header.source_mtime_nsec = config_files->stat.st_mtim.tv_nsec;
+	header.num_sounds = cfg->num_sounds;
+	header.num_triggers = cfg->num_triggers;
+	header.num_logfiles = cfg->num_logfiles;
+	header.arena_offset = CACHE_ARENA_OFFSET;
+	header.arena_size = cfg->arena_size;
+	header.sounds_offset = (uintptr_t)cache_offset(cfg, cfg->sounds);
+	header.triggers_offset = (uintptr_t)cache_offset(cfg, cfg->triggers);
+	header.logfiles_offset = (uintptr_t)cache_offset(cfg, cfg->logfiles);
+	header.num_groups = cfg->num_groups;
+	header.group_names_offset = (uintptr_t)cache_offset(cfg, cfg->group_names);
+	header.runtime = runtime;
+	header.audio = audio;
+	for (file = config_files->next; file != NULL; file = file->next)
+		header.num_includes++;
+	header.includes_offset = (CACHE_ARENA_OFFSET + cfg->arena_size + ARENA_ALIGN - 1) & ~(uint64_t)(ARENA_ALIGN - 1);
+	offset = header.includes_offset + sizeof(struct config_cache_include) * header.num_includes;
+	if (audio.driver_arguments != NULL) {
+		header.audio.driver_arguments = (xmlChar *)(uintptr_t)offset;
+		offset += xmlStrlen(audio.driver_arguments) + 1;
+	}
+	if (audio.sound_bank != NULL) {
+		header.audio.sound_bank = (xmlChar *)(uintptr_t)offset;
+		offset += xmlStrlen(audio.sound_bank) + 1;
+	}
+	includes = calloc(header.num_includes, sizeof(struct config_cache_include));
+	for (file = config_files->next, i = 0; file != NULL; file = file->next, i++) {
+		includes[i].size = file->stat.st_size;
+		includes[i].mtime_sec = file->stat.st_mtim.tv_sec;
+		includes[i].mtime_nsec = file->stat.st_mtim.tv_nsec;
+		includes[i].path_offset = offset;
+		offset += xmlStrlen(file->path) + 1;
+	}
+
+	f = fopen(CONFIG_CACHE ".tmp", "wb");
+	if (f == NULL) {
+		fprintf(stderr, "Unable to create %s: %s\n", CONFIG_CACHE, strerror(errno));
+		exit(1);
+	}
+	fwrite(&header, 1, sizeof(header), f);
+	fwrite(padding, 1, CACHE_ARENA_OFFSET - sizeof(header), f);
+	fwrite(copy, 1, cfg->arena_size, f);
+	fwrite(padding, 1, header.includes_offset - (CACHE_ARENA_OFFSET + cfg->arena_size), f);
+	fwrite(includes, sizeof(struct config_cache_include), header.num_includes, f);
+	if (audio.driver_arguments != NULL)
+		fwrite(audio.driver_arguments, 1, xmlStrlen(audio.driver_arguments) + 1, f);
+	if (audio.sound_bank != NULL)
+		fwrite(audio.sound_bank, 1, xmlStrlen(audio.sound_bank) + 1, f);
+	for (file = config_files->next; file != NULL; file = file->next)
+		fwrite(file->path, 1, xmlStrlen(file->path) + 1, f);
+	free(copy);
+	free(includes);
+
+	if (ferror(f) || fclose(f) != 0 || rename(CONFIG_CACHE ".tmp", CONFIG_CACHE) < 0) {
+		fprintf(stderr, "Unable to write %s: %s\n", CONFIG_CACHE, strerror(errno));
+		unlink(CONFIG_CACHE ".tmp");
+		exit(1);
+	}
+	printf("Compiled %d sounds, %d triggers and %d logfiles into %s (%zu KB)\n",
+			cfg->num_sounds, cfg->num_triggers, cfg->num_logfiles, CONFIG_CACHE,
+			(size_t)(CACHE_ARENA_OFFSET + cfg->arena_size) / 1024);
+}
+
+/* Turn a string's offset back into a pointer, or return false if it isn't a string in the file */
+static bool relocate_string(xmlChar **str, char *base, size_t size)
+{
+	uintptr_t offset = (uintptr_t)*str;
+
+	if (offset == 0)
+		return true;	/* NULL */
+	if (offset < CACHE_ARENA_OFFSET || offset >= size || memchr(base + offset, '\0', size - offset) == NULL)
+		return false;
+	*str = (xmlChar *)base + offset;
+	return true;
+}
+
+/* Turn an array's offset back into a pointer, or return false if it isn't in the arena */
+static bool relocate_array(void **array, int count, size_t elt_size, char *base,
+		const struct config_cache_header *header)
+{
+	uintptr_t offset = (uintptr_t)*array;
+	uint64_t arena_end = header->arena_offset + header->arena_size;
+
+	if (count < 0 || offset < header->arena_offset || offset % ARENA_ALIGN != 0 ||
+	    offset > arena_end || (uint64_t)count > (arena_end - offset) / elt_size)
+		return false;
+	*array = base + offset;
+	return true;
+}
+
+/* Relocate a logfile's trigger table, and check that it describes its attached triggers */
+static bool relocate_trigger_table(struct logfile *logfile, const struct config *cfg, char *base,
+		const struct config_cache_header *header)
+{
+	struct trigger_table *table = &logfile->table;
+	int n = table->count, i;
+
+	if (n != logfile->num_attached_triggers ||
+	    !relocate_array((void **)&table->pattern_len, n, sizeof(unsigned int), base, header) ||
+	    !relocate_array((void **)&table->first_byte, n, 1, base, header) ||
+	    !relocate_array((void **)&table->pattern_offset, n, sizeof(unsigned int), base, header) ||
+	    !relocate_array((void **)&table->trigger_id, n, sizeof(int), base, header) ||
+	    !relocate_array((void **)&table->sound_id, n, sizeof(int), base, header) ||
+	    !relocate_array((void **)&table->stop_search_on_match, n, sizeof(bool), base, header) ||
+	    !relocate_array((void **)&table->attached, n, sizeof(int), base, header) ||
+	    !relocate_array((void **)&table->group, n, 1, base, header) ||
+	    !relocate_array((void **)&table->patterns, table->patterns_size, 1, base, header))
+		return false;
+	for (i = 0; i < n; i++) {
+		if (table->pattern_offset[i] >= table->patterns_size ||
+		    table->pattern_len[i] >= table->patterns_size - table->pattern_offset[i] ||
+		    table->attached[i] != i ||
+		    table->trigger_id[i] != logfile->attached_triggers[i].trigger_id ||
+		    table->sound_id[i] != cfg->triggers[table->trigger_id[i]].sound_to_play_id ||
+		    table->group[i] != cfg->triggers[table->trigger_id[i]].group_id)
+			return false;
+	}
+	return true;
+}
+
+/* The config compiled into atconfig.bin, or NULL if there isn't an up to date one */
+static struct config *load_compiled_config(bool startup)
+{
+	struct config_cache_header *header;
+	struct config_cache_include *includes;
+	struct config_file *file;
+	struct stat cache_stat, source_stat;
+	xmlChar *path;
+	uint64_t all_groups;
+	struct config *cfg = NULL;
+	uint32_t sizes[5];
+	void *array;
+	char *base;
+	int fd, i, j;
+
+	fd = open(CONFIG_CACHE, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &cache_stat) < 0 || stat(CONFIG_XML, &source_stat) < 0 ||
+	    cache_stat.st_size < CACHE_ARENA_OFFSET) {
+		close(fd);
+		return NULL;
+	}
+	/* private and writable, as the pointers are fixed up in place */
+	base = mmap(NULL, cache_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	header = (struct config_cache_header *)base;
+	get_cache_struct_sizes(sizes);
+	if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->version != CACHE_VERSION || memcmp(header->sizes, sizes, sizeof(sizes)) != 0) {
+		fprintf(stderr, "WARNING: %s was compiled by a different version, run with --compile again\n", CONFIG_CACHE);
+		goto unusable;
+	}
+	if (header->source_size != source_stat.st_size ||
+	    header->source_mtime_sec != source_stat.st_mtim.tv_sec ||
+	    header->source_mtime_nsec != source_stat.st_mtim.tv_nsec) {
+		if (startup)
+			printf("%s has changed since %s was compiled, reading it instead\n", CONFIG_XML, CONFIG_CACHE);
+		goto unusable;
+	}
+	if (header->arena_offset != CACHE_ARENA_OFFSET || header->arena_size > cache_stat.st_size - CACHE_ARENA_OFFSET ||
+	    header->num_includes < 0 || header->includes_offset % ARENA_ALIGN != 0 ||
+	    header->includes_offset > cache_stat.st_size ||
+	    header->num_includes > (cache_stat.st_size - header->includes_offset) / sizeof(struct config_cache_include))
+		goto corrupt;
+	includes = (struct config_cache_include *)(base + header->includes_offset);
+	for (i = 0; i < header->num_includes; i++) {
+		path = (xmlChar *)(uintptr_t)includes[i].path_offset;
+		if (!relocate_string(&path, base, cache_stat.st_size))
+			goto corrupt;
+		if (stat((char *)path, &source_stat) < 0 ||
+		    includes[i].size != source_stat.st_size ||
+		    includes[i].mtime_sec != source_stat.st_mtim.tv_sec ||
+		    includes[i].mtime_nsec != source_stat.st_mtim.tv_nsec) {
+			if (startup)
+				printf("%s has changed since %s was compiled, reading %s instead\n",
+						path, CONFIG_CACHE, CONFIG_XML);
+			goto unusable;
+		}
+	}
+
+	cfg = calloc(1, sizeof(struct config));
+	atomic_init(&cfg->refs, 1);
+	cfg->mapping = base;
+	cfg->mapping_size = cache_stat.st_size;
+	cfg->num_sounds = header->num_sounds;
+	cfg->num_triggers = header->num_triggers;
+	cfg->num_logfiles = header->num_logfiles;
+	array = (void *)(uintptr_t)header->sounds_offset;
+	if (!relocate_array(&array, cfg->num_sounds, sizeof(struct sound), base, header))
+		goto corrupt;
+	cfg->sounds = array;
+	array = (void *)(uintptr_t)header->triggers_offset;
+	if (!relocate_array(&array, cfg->num_triggers, sizeof(struct trigger), base, header))
+		goto corrupt;
+	cfg->triggers = array;
+	array = (void *)(uintptr_t)header->logfiles_offset;
+	if (!relocate_array(&array, cfg->num_logfiles, sizeof(struct logfile), base, header))
+		goto corrupt;
+	cfg->logfiles = array;
+	if (header->num_groups < 0 || header->num_groups > MAX_TRIGGER_GROUPS)
+		goto corrupt;
+	cfg->num_groups = header->num_groups;
+	array = (void *)(uintptr_t)header->group_names_offset;
+	if (!relocate_array(&array, cfg->num_groups, sizeof(xmlChar *), base, header))
+		goto corrupt;
+	cfg->group_names = array;
+	for (i = 0; i < cfg->num_groups; i++) {
+		if (!relocate_string(&cfg->group_names[i], base, cache_stat.st_size))
+			goto corrupt;
+	}
+	all_groups = cfg->num_groups == MAX_TRIGGER_GROUPS ? ~0ULL : (1ULL << cfg->num_groups) - 1;
+
+	for (i = 0; i < cfg->num_sounds; i++) {
+		if (!relocate_string(&cfg->sounds[i].name, base, cache_stat.st_size) ||
+		    !relocate_string(&cfg->sounds[i].file, base, cache_stat.st_size))
+			goto corrupt;
+	}
+	for (i = 0; i < cfg->num_triggers; i++) {
+		if (!relocate_string(&cfg->triggers[i].name, base, cache_stat.st_size) ||
+		    !relocate_string(&cfg->triggers[i].pattern, base, cache_stat.st_size) ||
+		    !relocate_string(&cfg->triggers[i].sound_to_play, base, cache_stat.st_size) ||
+		    !relocate_string(&cfg->triggers[i].group, base, cache_stat.st_size) ||
+		    !relocate_string(&cfg->triggers[i].enable_groups, base, cache_stat.st_size) ||
+		    !relocate_string(&cfg->triggers[i].disable_groups, base, cache_stat.st_size) ||
+		    cfg->triggers[i].sound_to_play_id < NO_SOUND ||
+		    cfg->triggers[i].sound_to_play_id >= cfg->num_sounds ||
+		    cfg->triggers[i].group_id < NO_GROUP || cfg->triggers[i].group_id >= cfg->num_groups ||
+		    ((cfg->triggers[i].enables | cfg->triggers[i].disables) & ~all_groups) != 0)
+			goto corrupt;
+	}
+	for (i = 0; i < cfg->num_logfiles; i++) {
+		struct logfile *logfile = &cfg->logfiles[i];
+
+		if (!relocate_string(&logfile->file, base, cache_stat.st_size) ||
+		    !relocate_array((void **)&logfile->attached_triggers, logfile->num_attached_triggers,
+				sizeof(struct attached_trigger), base, header))
+			goto corrupt;
+		for (j = 0; j < logfile->num_attached_triggers; j++) {
+			if (!relocate_string(&logfile->attached_triggers[j].name, base, cache_stat.st_size) ||
+			    logfile->attached_triggers[j].trigger_id < 0 ||
+			    logfile->attached_triggers[j].trigger_id >= cfg->num_triggers)
+				goto corrupt;
+		}
+		if (!relocate_trigger_table(logfile, cfg, base, header))
+			goto corrupt;
+	}
+
+	if (startup) {
+		runtime = header->runtime;
+		audio = header->audio;
+		if (!relocate_string(&audio.driver_arguments, base, cache_stat.st_size) ||
+		    !relocate_string(&audio.sound_bank, base, cache_stat.st_size))
+			goto corrupt;
+		/* the settings outlive this config */
+		audio.driver_arguments = xmlStrdup(audio.driver_arguments);
+		audio.sound_bank = xmlStrdup(audio.sound_bank);
+	}
+	/* watch the packs it was compiled from */
+	for (file = config_files->next; file != NULL; file = file->next)
+		file->in_use = false;
+	for (i = 0; i < header->num_includes; i++)
+		find_config_file((xmlChar *)base + includes[i].path_offset)->in_use = true;
+	debugmsg("loaded the compiled config from %s\n", CONFIG_CACHE);
+	return cfg;
+
+corrupt:
+	fprintf(stderr, "WARNING: %s is damaged, run with --compile again\n", CONFIG_CACHE);
+	free(cfg);
+unusable:
+	munmap(base, cache_stat.st_size);
+	return NULL;
+}
+
+static xmlTextReaderPtr loading_reader;
+
+/* Read atconfig.xml into the config being loaded */
+static void read_config_xml(bool startup)
+{
+	int depth;
+
+	if (startup) {
+		init_runtime();
+		init_audio();
+	}
+
+	loading_reader = open_config_xml();
+	while (read_config_node(loading_reader) &&
+	       xmlTextReaderNodeType(loading_reader) != XML_READER_TYPE_ELEMENT)
+		;
+	if (!is_element(loading_reader, AUDIOTRIGGERS_ELT)) {
+		fprintf(stderr, "Unable to find <audiotriggers> element at root of %s\n", CONFIG_XML);
+		config_error();
+	}
+
+	foreach_child_element(loading_reader, depth) {
+		if (is_element(loading_reader, RUNTIME_ELT)) {
+			if (startup)
+				process_runtime_element(loading_reader);
+		} else if (is_element(loading_reader, AUDIO_ELT)) {
+			if (startup)
+				process_audio_element(loading_reader);
+		} else if (is_element(loading_reader, INCLUDE_ELT)) {
+			process_include_element(loading_reader);
+		} else if (is_element(loading_reader, SOUND_ELT)) {
+			process_sound_element(loading_reader);
+		} else if (is_element(loading_reader, TRIGGER_ELT)) {
+			process_trigger_element(loading_reader);
+		} else if (is_element(loading_reader, LOGFILE_ELT)) {
+			process_logfile_element(loading_reader);
+		}
+	}
+	/* validation errors in the last elements only show up at the end */
+	while (read_config_node(loading_reader))
+		;
+	close_config_xml(loading_reader);
+	loading_reader = NULL;
+}
+
+/* Read an included trigger pack into the config being loaded */
+static void read_trigger_pack(void)
+{
+	int depth;
+
+	loading_reader = open_config_xml();
+	while (read_config_node(loading_reader) &&
+	       xmlTextReaderNodeType(loading_reader) != XML_READER_TYPE_ELEMENT)
+		;
+	if (!is_element(loading_reader, TRIGGER_PACK_ELT)) {
+		fprintf(stderr, "Unable to find <trigger_pack> element at root of %s\n", reading_file);
+		config_error();
+	}
+
+	foreach_child_element(loading_reader, depth) {
+		if (is_element(loading_reader, SOUND_ELT))
+			process_sound_element(loading_reader);
+		else if (is_element(loading_reader, TRIGGER_ELT))
+			process_trigger_element(loading_reader);
+	}
+	while (read_config_node(loading_reader))
+		;
+	close_config_xml(loading_reader);
+	loading_reader = NULL;
+}
+
+/*
+ * GamTextTriggers' and EQ's own trigger files are imported straight into
+ * a config: each trigger in them becomes a trigger attached to the
+ * logfile importing the file, named after the file and the line it is
+ * on, and each sound file they play becomes one sound.  Trigger exports
+ * are full of repeats, so a trigger with the same pattern (in any case,
+ * as that is how they are matched) and sound as one already imported is
+ * left out.
+ */
+struct importer {
+	struct config_file *file;
+	xmlChar *sound_dir;		/* what the sound files are relative to */
+	struct name_index sounds;	/* by file */
+	struct name_index triggers;	/* by keys[] */
+	xmlChar **keys;
+	int num_keys;
+	int num_repeats;
+};
+/* While a file is being imported, so that load_config() can free it after an error */
+static struct importer *importing;
+
+static void free_importer(struct importer *imp)
+{
+	int i;
+
+	for (i = 0; i < imp->num_keys; i++)
+		xmlFree(imp->keys[i]);
+	free(imp->keys);
+	free_name_index(&imp->sounds);
+	free_name_index(&imp->triggers);
+	xmlFree(imp->sound_dir);
+	free(imp);
+}
+
+static bool is_absolute_path(const char *path)
+{
+	return path[0] == '/' || path[0] == '\\' || (path[0] != '\0' && path[1] == ':');
+}
+
+static void import_trigger(struct importer *imp, int line_num, const char *pattern, const char *sound_file)
+{
+	struct trigger *trigger;
+	struct attached_trigger *at;
+	struct logfile *logfile = &loading->logfiles[0];
+	xmlChar *file = NULL, *key;
+	char line[16];
+	int sound_id = NO_SOUND, i;
+
+	if (*pattern == '\0') {
+		fprintf(stderr, "WARNING: %s:%d: the trigger has no pattern, skipping it\n", imp->file->path, line_num);
+		return;
+	}
+	if (sound_file != NULL && *sound_file != '\0') {
+		if (is_absolute_path(sound_file))
+			file = xmlStrdup((xmlChar *)sound_file);
+		else
+			file = xmlStrncatNew(imp->sound_dir, (xmlChar *)sound_file, -1);
+		sound_id = add_to_name_index(&imp->sounds, file, loading->num_sounds);
+		if (sound_id >= 0) {
+			xmlFree(file);
+			file = loading->sounds[sound_id].file;
+		} else {
+			sound_id = loading->num_sounds;
+			add_sound(xmlStrcat(xmlStrncatNew(imp->file->path, (xmlChar *)":", -1),
+					(xmlChar *)sound_file))->file = file;
+		}
+	}
+
+	key = xmlStrncatNew((xmlChar *)pattern, (xmlChar *)"\n", -1);
+	for (i = 0; key[i] != '\n'; i++)
+		key[i] = tolower(key[i]);
+	if (file != NULL)
+		key = xmlStrcat(key, file);
+	if (add_to_name_index(&imp->triggers, key, loading->num_triggers) >= 0) {
+		xmlFree(key);
+		imp->num_repeats++;
+		return;
+	}
+	imp->keys = grow_array(imp->keys, imp->num_keys, sizeof(xmlChar *));
+	imp->keys[imp->num_keys++] = key;
+
+	snprintf(line, sizeof(line), ":%d", line_num);
+	trigger = add_trigger(xmlStrncatNew(imp->file->path, (xmlChar *)line, -1));
+	trigger->pattern = xmlStrdup((xmlChar *)pattern);
+	if (sound_id != NO_SOUND)
+		trigger->sound_to_play = xmlStrdup(loading->sounds[sound_id].name);
+
+	logfile->attached_triggers = grow_array(logfile->attached_triggers,
+			logfile->num_attached_triggers, sizeof(struct attached_trigger));
+	at = &logfile->attached_triggers[logfile->num_attached_triggers++];
+	at->name = xmlStrdup(trigger->name);
+	at->stop_search_on_match = false;
+	init_rate_limit(&at->rate_limit, 1, 0);
+}
+
+/* Strip the blanks around s */
+static char *trim(char *s)
+{
+	char *end;
+
+	while (isspace((unsigned char)*s))
+		s++;
+	end = s + strlen(s);
+	while (end > s && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+	return s;
+}
+
+/* GamTextTriggers puts a trigger on each line, as ;-separated fields such as "Trigger=...;SoundLink=...;" */
+static void import_gtt_line(struct importer *imp, int line_num, char *line)
+{
+	char *field, *value, *pattern = NULL, *sound_file = NULL;
+
+	while ((field = strsep(&line, ";")) != NULL) {
+		value = strchr(field, '=');
+		if (value == NULL)
+			continue;
+		*value++ = '\0';
+		field = trim(field);
+		if (strcasecmp(field, "Trigger") == 0)
+			pattern = value;
+		else if (strcasecmp(field, "SoundLink") == 0)
+			sound_file = trim(value);
+	}
+	if (pattern != NULL)
+		import_trigger(imp, line_num, pattern, sound_file);
+}
+
+/*
+ * EQ's audio triggers are an ini file with a [section] for each trigger.
+ * The pattern is its Text= (or SearchText=), and the sound its
+ * SoundFile= (or Sound=).  Sections without a pattern are settings.
+ */
+struct eq_section {
+	int line_num;
+	char *pattern, *sound_file;
+};
+
+static void import_eq_section(struct importer *imp, struct eq_section *section)
+{
+	if (section->pattern != NULL)
+		import_trigger(imp, section->line_num, section->pattern, section->sound_file);
+	section->pattern = section->sound_file = NULL;
+}
+
+static void import_eq_line(struct importer *imp, int line_num, char *line, struct eq_section *section)
+{
+	char *value;
+
+	line = trim(line);
+	if (*line == '[') {
+		import_eq_section(imp, section);
+		section->line_num = line_num;
+		return;
+	}
+	if (*line == ';' || *line == '#' || (value = strchr(line, '=')) == NULL)
+		return;
+	*value++ = '\0';
+	line = trim(line);
+	if (strcasecmp(line, "Text") == 0 || strcasecmp(line, "SearchText") == 0)
+		section->pattern = trim(value);
+	else if (strcasecmp(line, "SoundFile") == 0 || strcasecmp(line, "Sound") == 0)
+		section->sound_file = trim(value);
+}
+
+/* Import a GamTextTriggers or EQ trigger file into the config being loaded */
+static void import_trigger_file(struct config_file *file)
+{
+	struct importer *imp;
+	struct eq_section section = { 0 };
+	struct logfile *logfile;
+	char *text = config_text, *line, *slash;
+	int max_triggers = 1, line_num = 0, i;
+
+	config_text[config_text_len] = '\0';
+	for (i = 0; i < config_text_len; i++) {
+		if (config_text[i] == '\n')
+			max_triggers++;
+	}
+	importing = imp = calloc(1, sizeof(struct importer));
+	imp->file = file;
+	init_name_index(&imp->sounds, max_triggers);
+	init_name_index(&imp->triggers, max_triggers);
+	if (file->sound_dir != NULL) {
+		imp->sound_dir = xmlStrdup(file->sound_dir);
+		i = xmlStrlen(imp->sound_dir);
+		if (i > 0 && imp->sound_dir[i - 1] != '/' && imp->sound_dir[i - 1] != '\\')
+			imp->sound_dir = xmlStrcat(imp->sound_dir, (xmlChar *)"/");
+	} else {
+		/* next to the file */
+		slash = strrchr((char *)file->path, '/');
+		if (slash == NULL)
+			slash = strrchr((char *)file->path, '\\');
+		imp->sound_dir = xmlStrndup(file->path, slash != NULL ? slash + 1 - (char *)file->path : 0);
+	}
+
+	loading->logfiles = logfile = calloc(1, sizeof(struct logfile));
+	loading->num_logfiles = 1;
+	init_rate_limit(&logfile->rate_limit, 1, 0);
+
+	while ((line = strsep(&text, "\n")) != NULL) {
+		line_num++;
+		line[strcspn(line, "\r")] = '\0';
+		if (file->import_format == IMPORT_EQ)
+			import_eq_line(imp, line_num, line, &section);
+		else
+			import_gtt_line(imp, line_num, line);
+	}
+	if (file->import_format == IMPORT_EQ)
+		import_eq_section(imp, &section);
+
+	if (loading->num_triggers == 0)
+		fprintf(stderr, "WARNING: no triggers were found in %s\n", file->path);
+	debugmsg("imported %d triggers and %d sounds from %s, leaving out %d repeats\n",
+			loading->num_triggers, loading->num_sounds, file->path, imp->num_repeats);
+	free_importer(imp);
+	importing = NULL;
+	close_config_xml(NULL);
+}
+
+static bool same_mtime(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/* Forget the files atconfig.xml no longer includes or imports */
+static void drop_unused_config_files(void)
+{
+	struct config_file **filep, *file;
+
+	for (filep = &config_files->next; (file = *filep) != NULL; ) {
+		if (file->in_use) {
+			filep = &file->next;
+			continue;
+		}
+		debugmsg("%s is no longer included\n", file->path);
+		*filep = file->next;
+		if (file->parsed != NULL)
+			free_config(file->parsed);
+		xmlFree(file->path);
+		xmlFree(file->sound_dir);
+		free(file);
+	}
+}
+
+/* Bring what is kept of a file up to date, reading it again only if it has changed */
+static void update_config_file(struct config_file *file, bool startup)
+{
+	struct stat stat_buf;
+
+	if (file->parsed != NULL && stat((char *)file->path, &stat_buf) == 0 &&
+	    stat_buf.st_size == file->stat.st_size && same_mtime(&stat_buf.st_mtim, &file->stat.st_mtim))
+		return;
+
+	reading_file = (char *)file->path;
+	read_config_text();
+	if (file->parsed != NULL && config_text_hash == file->hash) {
+		debugmsg("%s was saved unchanged\n", file->path);
+		close_config_xml(NULL);
+	} else {
+		debugmsg("reading %s\n", file->path);
+		loading = calloc(1, sizeof(struct config));
+		if (file == config_files)
+			read_config_xml(startup);
+		else if (file->import_format != IMPORT_NONE)
+			import_trigger_file(file);
+		else
+			read_trigger_pack();
+		if (file->parsed != NULL)
+			free_config(file->parsed);
+		file->parsed = loading;
+		loading = NULL;
+	}
+	file->stat = config_text_stat;
+	file->hash = config_text_hash;
+}
+
+/* The first of atconfig.xml's imports before import i of the same file, or -1 */
+static int earlier_import(const struct config *top, int i)
+{
+	int j;
+
+	for (j = 0; j < i; j++) {
+		if (xmlStrEqual(top->imports[j].path, top->imports[i].path))
+			return j;
+	}
+	return -1;
+}
+
+/*
+ * What was read from atconfig.xml for part -1, then from its includes,
+ * then from its imports.  A file imported into several logfiles is only
+ * a part the first time, and NULL after that.
+ */
+static const struct config *config_part(int part)
+{
+	const struct config *top = config_files->parsed;
+
+	if (part < 0)
+		return top;
+	if (part < top->num_includes)
+		return find_config_file(top->includes[part])->parsed;
+	part -= top->num_includes;
+	if (earlier_import(top, part) >= 0)
+		return NULL;
+	return find_config_file(top->imports[part].path)->parsed;
+}
+
+/*
+ * Put the config being loaded together from atconfig.xml and the files
+ * it includes and imports.  The arrays are copied, as the names are
+ * resolved in them, but the strings stay with the config_files until the
+ * config is packed.  The triggers of an import are attached after those
+ * of its <logfile>'s own <attach_trigger>s, to every logfile that
+ * imports it.
+ */
+static void assemble_config(void)
+{
+	const struct config *top = config_files->parsed, *part;
+	const struct logfile *imported;
+	struct logfile *logfile;
+	int i, num_parts = top->num_includes + top->num_imports;
+	int num_sounds = top->num_sounds, num_triggers = top->num_triggers;
+
+	for (i = 0; i < num_parts; i++) {
+		if ((part = config_part(i)) == NULL)
+			continue;
+		num_sounds += part->num_sounds;
+		num_triggers += part->num_triggers;
+	}
+
+	loading = calloc(1, sizeof(struct config));
+	atomic_init(&loading->refs, 1);
+	loading->borrowed = true;
+	loading->sounds = malloc(sizeof(struct sound) * num_sounds);
+	loading->triggers = malloc(sizeof(struct trigger) * num_triggers);
+	for (i = -1; i < num_parts; i++) {
+		if ((part = config_part(i)) == NULL)
+			continue;
+		memcpy(&loading->sounds[loading->num_sounds], part->sounds,
+				sizeof(struct sound) * part->num_sounds);
+		loading->num_sounds += part->num_sounds;
+		memcpy(&loading->triggers[loading->num_triggers], part->triggers,
+				sizeof(struct trigger) * part->num_triggers);
+		loading->num_triggers += part->num_triggers;
+	}
+	loading->logfiles = malloc(sizeof(struct logfile) * top->num_logfiles);
+	for (i = 0; i < top->num_logfiles; i++) {
+		logfile = &loading->logfiles[i];
+		*logfile = top->logfiles[i];
+		logfile->attached_triggers = malloc(sizeof(struct attached_trigger) * logfile->num_attached_triggers);
+		memcpy(logfile->attached_triggers, top->logfiles[i].attached_triggers,
+				sizeof(struct attached_trigger) * logfile->num_attached_triggers);
+		loading->num_logfiles++;
+	}
+	for (i = 0; i < top->num_imports; i++) {
+		logfile = &loading->logfiles[top->imports[i].logfile];
+		imported = &find_config_file(top->imports[i].path)->parsed->logfiles[0];
+		logfile->attached_triggers = realloc(logfile->attached_triggers, sizeof(struct attached_trigger) *
+				(logfile->num_attached_triggers + imported->num_attached_triggers));
+		memcpy(&logfile->attached_triggers[logfile->num_attached_triggers], imported->attached_triggers,
+				sizeof(struct attached_trigger) * imported->num_attached_triggers);
+		logfile->num_attached_triggers += imported->num_attached_triggers;
+	}
+}
+
+/* Bring a file atconfig.xml includes or imports up to date, reading it again if it is now to be read differently */
+static void use_config_file(const xmlChar *path, enum import_format import_format, const xmlChar *sound_dir,
+		bool startup)
+{
+	struct config_file *file = find_config_file(path);
+
+	if (file->in_use) {
+		fprintf(stderr, "Duplicate include or import: %s\n", file->path);
+		config_error();
+	}
+	file->in_use = true;
+	if (file->import_format != import_format || !xmlStrEqual(file->sound_dir, sound_dir)) {
+		if (file->parsed != NULL)
+			free_config(file->parsed);
+		file->parsed = NULL;
+		file->import_format = import_format;
+		xmlFree(file->sound_dir);
+		file->sound_dir = xmlStrdup(sound_dir);
+	}
+	update_config_file(file, startup);
+}
+
+/* Read the files that have changed, and make a config of them all */
+static void read_config_files(bool startup)
+{
+	const struct config *top;
+	struct config_file *file;
+	int i, j;
+
+	update_config_file(config_files, startup);
+	top = config_files->parsed;
+	for (file = config_files->next; file != NULL; file = file->next)
+		file->in_use = false;
+	for (i = 0; i < top->num_includes; i++)
+		use_config_file(top->includes[i], IMPORT_NONE, NULL, startup);
+	for (i = 0; i < top->num_imports; i++) {
+		/* a file imported into several logfiles is read once, and has to be read the same way */
+		for (j = 0; j < i; j++) {
+			if (top->imports[j].logfile == top->imports[i].logfile &&
+			    xmlStrEqual(top->imports[j].path, top->imports[i].path)) {
+				fprintf(stderr, "Duplicate import: %s for logfile: %s\n", top->imports[i].path,
+						top->logfiles[top->imports[i].logfile].file);
+				config_error();
+			}
+		}
+		j = earlier_import(top, i);
+		if (j < 0) {
+			use_config_file(top->imports[i].path, top->imports[i].format, top->imports[i].sound_dir,
+					startup);
+		} else if (top->imports[j].format != top->imports[i].format ||
+			   !xmlStrEqual(top->imports[j].sound_dir, top->imports[i].sound_dir)) {
+			fprintf(stderr, "%s is imported with a different format or sound_dir for logfile: %s\n",
+					top->imports[i].path, top->logfiles[top->imports[i].logfile].file);
+			config_error();
+		}
+	}
 
+	assemble_config();
+	match_triggers_with_sounds();
 	match_logfiles_with_triggers();
+	match_trigger_groups();
+	pack_config(loading);
+}
+
+/* Cleared by --compile, which has to read the XML */
+static bool use_compiled_config = true;
+
+/*
+ * Load a new config from atconfig.bin if it is up to date, otherwise
+ * from atconfig.xml.  <runtime> and <audio> are only read at startup,
+ * as they set up threads and the sound system.  Errors exit at startup;
+ * while reloading, they return NULL instead.
+ */
+static struct config *load_config(bool startup)
+{
+	jmp_buf error_jmp;
+
+	loading = NULL;
+	if (config_files == NULL)
+		find_config_file((xmlChar *)CONFIG_XML);
+	if (!startup) {
+		if (setjmp(error_jmp)) {
+			config_error_jmp = NULL;
+			close_config_xml(loading_reader);
+			loading_reader = NULL;
+			if (importing != NULL)
+				free_importer(importing);
+			importing = NULL;
+			/* with the sounds and triggers read so far */
+			if (loading != NULL)
+				free_config(loading);
+			return NULL;
+		}
+		config_error_jmp = &error_jmp;
+	}
+
+	if (use_compiled_config)
+		loading = load_compiled_config(startup);
+	if (loading == NULL)
+		read_config_files(startup);
+	check_sound_files();
+	drop_unused_config_files();
+
+	config_error_jmp = NULL;
+	return loading;
+}
+
+static void free_config(struct config *cfg)
+{
+	if (cfg->mapping != NULL)
+		munmap(cfg->mapping, cfg->mapping_size);
+	else if (cfg->arena != NULL)
+		free(cfg->arena);
+	else
+		free_config_parts(cfg);	/* it failed to load */
+	free(cfg);
+}
+
+/* Handed from the main thread to the dispatcher by a reload */
+static _Atomic(struct config *) pending_config;
+/* Configs that were replaced, and may still be referred to */
+static struct config *retired_configs;
+
+/*
+ * Load the sounds a config needs, once resolve_sound_files() has found
+ * them, and make it the current one
+ */
+static void install_config(FMOD_SYSTEM *system, struct config *cfg)
+{
+	struct config *old;
+
+	start_loading_sounds(system, cfg);
+	/* being the current config keeps its sound data from now on */
+	resolving_config = NULL;
+
+	pthread_mutex_lock(&config_lock);
+	old = config;
+	cfg->generation = old ? old->generation + 1 : 1;
+	config = cfg;
+	atomic_store(&config_generation, cfg->generation);
+	pthread_mutex_unlock(&config_lock);
+
+	if (old != NULL) {
+		put_config(old);
+		old->next_retired = retired_configs;
+		retired_configs = old;
+		sounds_reported = false;
+	}
+}
+
+/* Release the sound files no config uses any more */
+static void release_unused_sound_data(void)
+{
+	struct config *cfg;
+	bool *used = calloc(num_sound_data, sizeof(bool));
+	int i;
+
+	for (i = 0; i < config->num_sounds; i++)
+		used[config->sounds[i].data_id] = true;
+	for (cfg = retired_configs; cfg != NULL; cfg = cfg->next_retired) {
+		for (i = 0; i < cfg->num_sounds; i++)
+			used[cfg->sounds[i].data_id] = true;
+	}
+	/* nor the ones a reload has found for its config so far */
+	if (resolving_config != NULL) {
+		for (i = 0; i < resolving_config->num_sounds; i++) {
+			if (resolving_config->sounds[i].data_id >= 0)
+				used[resolving_config->sounds[i].data_id] = true;
+		}
+	}
+	for (i = 0; i < num_sound_data; i++) {
+		if (used[i] || sound_data[i].path == NULL)
+			continue;
+		debugmsg("releasing sound file %s\n", sound_data[i].path);
+		if (sound_data[i].state == SOUND_LOADING)
+			num_sounds_loading--;
+		if (sound_data[i].state != SOUND_UNLOADED && sound_data[i].fmod_sound != NULL)
+			FMOD_Sound_Release(sound_data[i].fmod_sound);
+		if (sound_data[i].in_cache)
+			sound_cache_used -= sound_data[i].memory;
+		sound_data[i].in_cache = false;
+		sound_data[i].state = SOUND_UNLOADED;
+		/* nothing refers to it any more, so the entry can be reused */
+		free(sound_data[i].path);
+		sound_data[i].path = NULL;
+		free(sound_data[i].pending);
+	}
+	free(used);
+}
+
+/* Called by the dispatcher to free the retired configs nothing refers to any more */
+static void reclaim_configs(void)
+{
+	struct config **cfgp, *cfg;
+	bool freed = false;
+
+	for (cfgp = &retired_configs; (cfg = *cfgp) != NULL; ) {
+		if (atomic_load(&cfg->refs) == 0) {
+			debugmsg("freeing config generation %u\n", cfg->generation);
+			*cfgp = cfg->next_retired;
+			free_config(cfg);
+			freed = true;
+		} else {
+			cfgp = &cfg->next_retired;
+		}
+	}
+	if (freed)
+		release_unused_sound_data();
+}
+
+static void release_all_sounds(void)
+{
+	int i;
+	FMOD_RESULT result;
+
+	for (i = 0; i < num_sound_data; i++) {
+		if (sound_data[i].state == SOUND_UNLOADED || sound_data[i].fmod_sound == NULL)
+			continue;
+		result = FMOD_Sound_Release(sound_data[i].fmod_sound);
+		ERRCHECK(result);
+	}
+}
+
+static void close_sound_system(FMOD_SYSTEM *system)
+{
+	FMOD_RESULT result;
+
+	result = FMOD_System_Close(system);
+	ERRCHECK(result);
+	result = FMOD_System_Release(system);
+	ERRCHECK(result);
+}
+
+static void print_thankyou(void) {
+	printf("---------------------------------------------------\n");
+	printf("--              AudioTriggers+ 1.0               --\n");
+	printf("--                                               --\n");
+	printf("--  Implementation uses the FMODex Sound System  --\n");
+	printf("--    from Firelight Technologies @ FMOD.org     --\n");
+	printf("---------------------------------------------------\n");
+}
+
+/* One sample of FMOD PCM data as a float between -1 and 1 */
+static float pcm_sample(const void *pcm, FMOD_SOUND_FORMAT format, size_t i)
+{
+	const unsigned char *p;
+
+	switch (format) {
+	case FMOD_SOUND_FORMAT_PCM8:
+		return ((const int8_t *)pcm)[i] / 128.0f;
+	case FMOD_SOUND_FORMAT_PCM16:
+		return ((const int16_t *)pcm)[i] / 32768.0f;
+	case FMOD_SOUND_FORMAT_PCM24:
+		p = (const unsigned char *)pcm + i * 3;
+		return (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) / 2147483648.0f;
+	case FMOD_SOUND_FORMAT_PCM32:
+		return ((const int32_t *)pcm)[i] / 2147483648.0f;
+	case FMOD_SOUND_FORMAT_PCMFLOAT:
+		return ((const float *)pcm)[i];
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Decode a sound file to 16 bit PCM at the given sample rate, resampling
+ * it linearly.  Returns NULL if FMOD can't decode it to PCM.
+ */
+static int16_t *decode_sound_file(FMOD_SYSTEM *system, const char *path, int rate,
+		int *channels, size_t *frames)
+{
+	FMOD_SOUND *sound;
+	FMOD_SOUND_TYPE type;
+	FMOD_SOUND_FORMAT format;
+	FMOD_RESULT result;
+	unsigned int length, len1, len2;
+	void *ptr1, *ptr2;
+	float freq, vol, pan;
+	int prio, bits;
+	size_t in_frames, i, j;
+	int16_t *pcm;
+	int c;
+
+	result = FMOD_System_CreateSound(system, path, FMOD_SOFTWARE | FMOD_LOOP_OFF | FMOD_CREATESAMPLE, 0, &sound);
+	if (result != FMOD_OK) {
+		fprintf(stderr, "WARNING: Unable to decode \"%s\": %s\n", path, FMOD_ErrorString(result));
+		return NULL;
+	}
+	result = FMOD_Sound_GetFormat(sound, &type, &format, channels, &bits);
+	ERRCHECK(result);
+	result = FMOD_Sound_GetDefaults(sound, &freq, &vol, &pan, &prio);
+	ERRCHECK(result);
+	result = FMOD_Sound_GetLength(sound, &length, FMOD_TIMEUNIT_PCMBYTES);
+	ERRCHECK(result);
+	if (format < FMOD_SOUND_FORMAT_PCM8 || format > FMOD_SOUND_FORMAT_PCMFLOAT || bits == 0) {
+		fprintf(stderr, "WARNING: \"%s\" doesn't decode to PCM, leaving it out\n", path);
+		FMOD_Sound_Release(sound);
+		return NULL;
+	}
+	result = FMOD_Sound_Lock(sound, 0, length, &ptr1, &ptr2, &len1, &len2);
+	ERRCHECK(result);
+
+	in_frames = len1 / (bits / 8 * *channels);
+	*frames = (size_t)((double)in_frames * rate / freq);
+	pcm = malloc(*frames * *channels * sizeof(int16_t) + 1);
+	for (i = 0; i < *frames; i++) {
+		double pos = (double)i * freq / rate;
+		double frac;
+
+		j = (size_t)pos;
+		frac = pos - j;
+		for (c = 0; c < *channels; c++) {
+			float a = pcm_sample(ptr1, format, j * *channels + c);
+			float b = j + 1 < in_frames ? pcm_sample(ptr1, format, (j + 1) * *channels + c) : a;
+			double v = a + (b - a) * frac;
+
+			pcm[i * *channels + c] = (int16_t)lrint(fmax(-1.0, fmin(v, 32767.0 / 32768.0)) * 32768.0);
+		}
+	}
+
+	FMOD_Sound_Unlock(sound, ptr1, ptr2, len1, len2);
+	FMOD_Sound_Release(sound);
+	return pcm;
+}
+
+/*
+ * --build-bank: decode every sound file the configuration keeps as PCM
+ * (not the compressed or streamed ones) into a sound bank, for
+ * <sound_bank> to load.
+ */
+static void build_sound_bank(struct config *cfg, const char *bank_file)
+{
+	static const char padding[BANK_ALIGN + BANK_PAD];
+	struct bank_header header;
+	struct bank_entry *entries;
+	FMOD_SYSTEM *system;
+	FMOD_SOUND_FORMAT format;
+	FMOD_DSP_RESAMPLER resampler;
+	int rate, num_output_channels, max_input_channels, bits, channels;
+	FMOD_RESULT result;
+	uint64_t offset;
+	size_t frames;
+	int16_t *pcm;
+	FILE *f;
+	int i, n;
+
+	/* only used to decode, so it needs no sound card */
+	result = FMOD_System_Create(&system);
+	ERRCHECK(result);
+	result = FMOD_System_SetOutput(system, FMOD_OUTPUTTYPE_NOSOUND_NRT);
+	ERRCHECK(result);
+	result = FMOD_System_Init(system, 1, FMOD_INIT_NORMAL, NULL);
+	ERRCHECK(result);
+	result = FMOD_System_GetSoftwareFormat(system, &rate, &format, &num_output_channels,
+			&max_input_channels, &resampler, &bits);
+	ERRCHECK(result);
+	if (audio.sample_rate)
+		rate = audio.sample_rate;
+
+	resolve_sound_files(cfg);
+
+	entries = calloc(num_sound_data, sizeof(struct bank_entry));
+
+	f = fopen(bank_file, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "Unable to create sound bank %s: %s\n", bank_file, strerror(errno));
+		exit(1);
+	}
+	/* the header and index go in last, once the offsets are known */
+	offset = sizeof(header) + num_sound_data * sizeof(struct bank_entry);
+	fseek(f, offset, SEEK_SET);
+	for (i = 0; i < num_sound_data; i++) {
+		if (sound_data[i].path == NULL || sound_data[i].storage != STORAGE_PCM)
+			continue;
+		entries[i].name_offset = offset;
+		fwrite(sound_data[i].path, 1, strlen(sound_data[i].path) + 1, f);
+		offset += strlen(sound_data[i].path) + 1;
+	}
+
+	for (i = 0, n = 0; i < num_sound_data; i++) {
+		/* what <storage> or the memory budget keep compressed or streamed stays out */
+		if (sound_data[i].path == NULL || sound_data[i].storage != STORAGE_PCM)
+			continue;
+		pcm = decode_sound_file(system, sound_data[i].path, rate, &channels, &frames);
+		if (pcm == NULL)
+			continue;
+		/* align the data, with silence in front of it ... */
+		fwrite(padding, 1, (BANK_ALIGN - offset % BANK_ALIGN) % BANK_ALIGN + BANK_PAD, f);
+		offset += (BANK_ALIGN - offset % BANK_ALIGN) % BANK_ALIGN + BANK_PAD;
+		entries[n] = entries[i];
+		entries[n].data_offset = offset;
+		entries[n].data_length = frames * channels * sizeof(int16_t);
+		entries[n].file_size = sound_data[i].size;
+		entries[n].file_mtime = sound_data[i].mtime;
+		entries[n].file_mtime_nsec = sound_data[i].mtime_nsec;
+		entries[n].channels = channels;
+		fwrite(pcm, 1, entries[n].data_length, f);
+		offset += entries[n].data_length;
+		/* ... and after it */
+		fwrite(padding, 1, BANK_PAD, f);
+		offset += BANK_PAD;
+		free(pcm);
+		n++;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BANK_MAGIC, sizeof(BANK_MAGIC));
+	header.version = BANK_VERSION;
+	header.sample_rate = rate;
+	header.num_entries = n;
+	fseek(f, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(entries, sizeof(struct bank_entry), n, f);
+	if (ferror(f) || fclose(f) != 0) {
+		fprintf(stderr, "Unable to write sound bank %s: %s\n", bank_file, strerror(errno));
+		exit(1);
+	}
+	printf("Wrote %d sounds at %d Hz (%" PRIu64 " KB) to %s\n", n, rate, offset / 1024, bank_file);
+
+	free(entries);
+	close_sound_system(system);
+}
+
+struct dispatcher_info {
+	pthread_t thread;
+	FMOD_SYSTEM *system;
+};
+
+/* Plays the sounds the logwatchers enqueue.  Once started, this thread owns the FMOD system. */
+void *dispatcher(void *arg)
+{
+	struct dispatcher_info *di = arg;
+	int64_t update_interval_ns = (int64_t)audio.update_interval * NS_IN_MS;
+	int64_t next_update = 0, next_reclaim = 0;
+
+	apply_thread_settings(&runtime.dispatcher, "dispatcher");
+	init_channel_slots();
 
-	print_thankyou();
-	/*
-	 Main loop.
-	 */
 	pthread_mutex_lock(&events.lock);
 	while (1) {
-		int sound_id;
+		struct event_buffer_entry event;
+		int64_t now = now_ns();
+
+		/*
+		 * FMOD does its channel bookkeeping and makes its callbacks from
+		 * FMOD_System_Update(), so keep calling it even when there is
+		 * nothing to play.
+		 */
+		if (now >= next_update) {
+			pthread_mutex_unlock(&events.lock);
+			pthread_mutex_lock(&sound_data_lock);
+			FMOD_System_Update(di->system);
+			if (num_free_slots == 0 && now >= next_reclaim) {
+				reclaim_channel_slots();
+				next_reclaim = now + (int64_t)RECLAIM_INTERVAL_MS * NS_IN_MS;
+			}
+			if (atomic_load(&pending_config) != NULL) {
+				install_config(di->system, pending_config);
+				atomic_store(&pending_config, NULL);
+			}
+			if (retired_configs != NULL)
+				reclaim_configs();
+			if (num_sounds_loading > 0 || !sounds_reported)
+				poll_loading_sounds(di->system);
+			if (sound_stats_requested) {
+				sound_stats_requested = 0;
+				print_sound_stats();
+			}
+			pthread_mutex_unlock(&sound_data_lock);
+			next_update = now + update_interval_ns;
+			pthread_mutex_lock(&events.lock);
+			continue;
+		}
+		if (events.cur == events.next) {
+			struct timespec deadline = {
+				next_update / NS_IN_SEC,
+				next_update % NS_IN_SEC,
+			};
 
-		while (events.cur == events.next) {
-			debugmsg("event queue is empty\n");
-			pthread_cond_wait(&events.events_available, &events.lock);
+			pthread_cond_timedwait(&events.events_available, &events.lock, &deadline);
+			continue;
 		}
 		events.cur = (events.cur + 1) % NUM_EVENTS;
+		event = events.entry[events.cur];
 
-		sound_id = events.entry[events.cur].sound_id;
-		debugmsg("main loop received sound_id %d\n", sound_id);
-		if (sound_id < num_sounds) {
-			int free_channel;
+		/* Don't hold up the logwatchers while talking to FMOD */
+		pthread_mutex_unlock(&events.lock);
 
-			free_channel = find_free_channel();
-			if (free_channel == -1) {
-				fprintf(stderr, "WARNING: No free channels! Dropping sound\n");
-			} else {
-				result = FMOD_System_PlaySound(system,
-						FMOD_CHANNEL_FREE, fmod_sounds[sound_id], 0, &channel[free_channel]);
-				ERRCHECK(result);
-			}
-		} else {
-			fprintf(stderr, "sound_id: %d exceeds the last sound_id: %d\n", sound_id, num_sounds - 1);
+		debugmsg("dispatcher received sound_id %d\n", event.sound_id);
+		if (event.sound_id >= event.config->num_sounds) {
+			fprintf(stderr, "sound_id: %d exceeds the last sound_id: %d\n", event.sound_id, event.config->num_sounds - 1);
 			exit(1);
 		}
+		if (!event_expired(&event)) {
+			pthread_mutex_lock(&sound_data_lock);
+			request_sound(di->system, &event);
+			pthread_mutex_unlock(&sound_data_lock);
+		}
+		put_config(event.config);
+
+		pthread_mutex_lock(&events.lock);
+	}
+	return NULL;
+}
+
+static volatile sig_atomic_t reload_requested;
+
+static void request_reload(int sig)
+{
+	reload_requested = 1;
+}
+
+/*
+ * Reload atconfig.xml on SIGHUP, or once it or a file it includes or
+ * imports has been changed and then left alone for a second, so a half saved file
+ * isn't picked up.  The dispatcher swaps the new config in; events
+ * already queued finish with the config they were triggered under.
+ */
+static void watch_config(void)
+{
+	struct config_file *file;
+	struct stat stat_buf;
+	struct config *cfg;
+	bool changed;
+
+	while (1) {
+		sleep(1);
+		changed = false;
+		for (file = config_files; file != NULL; file = file->next) {
+			if (stat((char *)file->path, &stat_buf) == 0 && !same_mtime(&stat_buf.st_mtim, &file->seen)) {
+				file->seen = stat_buf.st_mtim;
+				changed = true;
+			}
+		}
+		if (changed)
+			continue;
+		changed = reload_requested;
+		for (file = config_files; file != NULL; file = file->next) {
+			if (!same_mtime(&file->seen, &file->settled)) {
+				file->settled = file->seen;
+				changed = true;
+			}
+		}
+		if (!changed)
+			continue;
+		reload_requested = 0;
+
+		printf("Reloading %s\n", CONFIG_XML);
+		cfg = load_config(false);
+		if (cfg == NULL) {
+			fprintf(stderr, "WARNING: %s has errors, still using the previous configuration\n", CONFIG_XML);
+			continue;
+		}
+		/* looking at the sound files here leaves the dispatcher free to play */
+		resolve_sound_files(cfg);
+		stop_dropped_logwatchers(cfg);
+		atomic_store(&pending_config, cfg);
+		while (atomic_load(&pending_config) != NULL)
+			usleep(10 * 1000);
+		update_logwatchers(cfg);
+		printf("Loaded %d sounds, %d triggers and %d logfiles\n", cfg->num_sounds,
+				cfg->num_triggers, cfg->num_logfiles);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	FMOD_SYSTEM *system;
+	struct dispatcher_info di;
+	pthread_condattr_t condattr;
+	struct config *cfg;
+	struct sigaction sa;
+	const char *bank_file = NULL;
+	bool compile = false;
+	int ret;
+
+	if (argc == 3 && strcmp(argv[1], "--build-bank") == 0) {
+		bank_file = argv[2];
+	} else if (argc == 2 && strcmp(argv[1], "--compile") == 0) {
+		compile = true;
+		use_compiled_config = false;
+	} else if (argc > 1) {
+		fprintf(stderr, "usage: %s [--build-bank <sound bank file> | --compile]\n", argv[0]);
+		exit(1);
+	}
+
+	/* the dispatcher's timed waits are against CLOCK_MONOTONIC, like now_ns() */
+	pthread_condattr_init(&condattr);
+	pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+	ret = pthread_cond_init(&events.events_available, &condattr);
+	if (ret < 0) {
+		fprintf(stderr, "Unable to initialize the events cond object\n");
+	}
+	ret = pthread_mutex_init(&events.lock, NULL);
+	if (ret < 0) {
+		fprintf(stderr, "Unable to initialize the events lock object\n");
+	}
+
+	/* kill -USR1 prints the sound usage statistics, kill -HUP reloads the config */
+	sa.sa_handler = request_sound_stats;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+	sa.sa_handler = request_reload;
+	sigaction(SIGHUP, &sa, NULL);
+
+	init_xml_lib();
+
+	cfg = load_config(true);
+
+	if (compile) {
+		compile_config(cfg);
+		return 0;
+	}
+	if (bank_file != NULL) {
+		build_sound_bank(cfg, bank_file);
+		return 0;
+	}
+
+	init_sound_system(&system);
+	create_default_beep(system);
+	open_sound_bank();
+	resolve_sound_files(cfg);
+	install_config(system, cfg);
+
+	/* start watching right away, the sounds finish loading in the background */
+	if (!update_logwatchers(cfg))
+		exit(1);
+
+	print_thankyou();
+
+	di.system = system;
+	ret = pthread_create(&di.thread, NULL, dispatcher, &di);
+	if (ret != 0) {
+		fprintf(stderr, "Unable to create the dispatcher pthread: %s\n", strerror(ret));
+		exit(1);
 	}
+	watch_config();
 
-	release_all_sounds(fmod_sounds);
+	release_all_sounds();
 	close_sound_system(system);
 
 	return 0;